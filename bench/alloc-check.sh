@@ -0,0 +1,51 @@
+#!/bin/sh
+
+# Check that midizap doesn't allocate any memory while processing MIDI input.
+# Usage: bench/alloc-check.sh
+
+# This replays each input stream of the benchmark corpus (see perf-check.sh)
+# with bench/alloccount.so preloaded, once as is and once with all debugging
+# options (-d) enabled, and fails if any heap allocation is made during the
+# replay.
+
+cd "$(dirname "$0")/.."
+
+if [ ! -x ./midizap ] || [ ! -f bench/alloccount.so ]; then
+    echo "alloc-check: build midizap and bench/alloccount.so first" >&2
+    exit 2
+fi
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+failed=0
+for input in bench/*.mid; do
+    name=$(basename "$input" .mid)
+    if [ "$name" = example ]; then
+	config=example.midizaprc
+    else
+	config=examples/$name.midizaprc
+    fi
+    # midizap writes a cache file next to the configuration, so we work
+    # on a copy to keep the source tree clean
+    cp "$config" "$tmp/" || exit 2
+    config=$tmp/$(basename "$config")
+    focus=
+    if [ -f bench/$name.focus ]; then focus="--focus bench/$name.focus"; fi
+    for opts in "" -d; do
+	out=$(LD_PRELOAD=./bench/alloccount.so ./midizap $opts --replay "$input" $focus --out /dev/null "$config" 2>&1 >/dev/null)
+	n=$(echo "$out" | sed -n 's/^\([0-9]*\) heap allocations$/\1/p')
+	if [ -z "$n" ]; then
+	    echo "$name: replay failed:" >&2
+	    echo "$out" >&2
+	    exit 2
+	fi
+	printf "%-14s %-3s %d allocations\n" "$name" "$opts" "$n"
+	if [ "$n" -ne 0 ]; then failed=$((failed+1)); fi
+    done
+done
+
+if [ $failed -ne 0 ]; then
+    echo "alloc-check: $failed replay(s) allocated memory"
+    exit 1
+fi
@@ -0,0 +1,66 @@
+
+/*
+
+  Heap allocation counter for the benchmark (make perf-check).
+
+  Preload this library (LD_PRELOAD=bench/alloccount.so) to count the calls
+  to malloc() and friends. midizap --replay looks for the alloc_count()
+  function and, if it's there, reports the number of allocations made while
+  replaying. Note that glibc routes its own internal allocations (strdup,
+  open_memstream, etc.) through the interposed malloc, so these are counted
+  as well.
+
+*/
+
+#include <stddef.h>
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+extern void *__libc_memalign(size_t align, size_t size);
+
+static unsigned long count = 0;
+
+unsigned long alloc_count(void)
+{
+  return __atomic_load_n(&count, __ATOMIC_RELAXED);
+}
+
+#define COUNT __atomic_fetch_add(&count, 1, __ATOMIC_RELAXED)
+
+void *malloc(size_t size)
+{
+  COUNT;
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+  COUNT;
+  return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size)
+{
+  COUNT;
+  return __libc_realloc(p, size);
+}
+
+void *memalign(size_t align, size_t size)
+{
+  COUNT;
+  return __libc_memalign(align, size);
+}
+
+void *aligned_alloc(size_t align, size_t size)
+{
+  COUNT;
+  return __libc_memalign(align, size);
+}
+
+int posix_memalign(void **p, size_t align, size_t size)
+{
+  COUNT;
+  if (!(*p = __libc_memalign(align, size))) return 12; // ENOMEM
+  return 0;
+}
@@ -0,0 +1,155 @@
+#!/usr/bin/env python3
+
+# Create the input streams of the benchmark corpus (see bench/README.md).
+# Usage: bench/mkinput.py config.midizaprc output.mid
+
+# This looks at the left-hand sides of the translations in the given
+# configuration and plays the corresponding controls in random order, the
+# way a user would: buttons are pressed and released, faders and knobs are
+# moved through their range, encoders are turned a few clicks at a time.
+# Shift keys are held down while operating some other controls, so that the
+# shifted translations get their share. Messages bound in the [MIDI2]
+# section go to the second input port if the configuration has two. The
+# random generator is seeded from the configuration name, so running this
+# again gives the same stream.
+
+import random, re, struct, sys, os
+
+N_EVENTS = 20000
+DIVISION = 480 # ticks per quarter, at the default 120 bpm a tick is ~1 ms
+
+note_names = { 'C': 0, 'D': 2, 'E': 4, 'F': 5, 'G': 7, 'A': 9, 'B': 11 }
+
+lhs_re = re.compile(r"(?:\d*\^)?(KP:)?(CC\d+|PC\d+|PB|CP|[A-G][#b]?-?\d+)"
+                    r"(\[[^]]*\](?:\{[^}]*\})?)?(?:-(\d+))?([~=+<>'-])?$")
+
+def parse(name):
+    controls = {}
+    midi_octave = 0
+    n_ports = 1
+    port = None
+    for line in open(name):
+        # '#' only starts a comment at the beginning of a token
+        line = re.sub(r"(^|\s)#.*", "", line).strip()
+        if not line: continue
+        if line.startswith("["):
+            m = re.match(r"\[([^]]*)\]", line)
+            port = 1 if m and m.group(1) == "MIDI2" else 0
+            continue
+        tok = line.split()[0]
+        if port is None:
+            if tok == "MIDI_OCTAVE": midi_octave = int(line.split()[1])
+            if tok == "JACK_PORTS": n_ports = int(line.split()[1])
+            continue
+        if port >= n_ports: continue
+        m = lhs_re.match(tok)
+        if not m: continue
+        kp, msg, step, chan, incr = m.groups()
+        chan = int(chan)-1 if chan else 0
+        if msg.startswith("CC"):
+            kind, data = "cc", int(msg[2:])
+        elif msg.startswith("PC"):
+            kind, data = "pc", int(msg[2:])
+        elif msg in ("PB", "CP"):
+            kind, data = msg.lower(), 0
+        else:
+            n = re.match(r"([A-G])([#b]?)(-?\d+)", msg)
+            data = note_names[n.group(1)] + {"#": 1, "b": -1, "": 0}[n.group(2)] \
+                + 12*(int(n.group(3)) - midi_octave)
+            kind = "kp" if kp else "note"
+        if not 0 <= data < 128 or not 0 <= chan < 16: continue
+        if re.search(r"\sSHIFT\d?\s", line) and kind in ("note", "cc"):
+            mode = "shift"
+        elif incr in ("~", "+", "-", "<", ">"):
+            mode = "enc"
+        elif step or incr == "=" or kind in ("pb", "cp", "kp"):
+            mode = "sweep"
+        else:
+            mode = "key"
+        # shift keys and incremental bindings take precedence, since that's
+        # how the control must be operated
+        key = (port, kind, chan, data)
+        if key not in controls or mode in ("enc", "shift"):
+            controls[key] = mode
+    return sorted(controls.items())
+
+def press(control, on):
+    (port, kind, chan, data), mode = control
+    if kind == "note":
+        return (port, [(0x90 if on else 0x80)+chan, data, 127 if on else 0])
+    return (port, [0xb0+chan, data, 127 if on else 0])
+
+def sweep(lo, hi, rnd):
+    a, b = sorted((rnd.randint(lo, hi), rnd.randint(lo, hi)))
+    step = max(1, (hi-lo+1)//rnd.randint(16, 64))
+    vals = list(range(a, b+1, step))
+    return vals if rnd.random() < 0.5 else vals[::-1]
+
+def gesture(controls, control, rnd):
+    (port, kind, chan, data), mode = control
+    if mode == "shift":
+        others = [c for c in controls if c[1] != "shift"]
+        msgs = [press(control, True)]
+        for i in range(rnd.randint(1, 4) if others else 0):
+            msgs += gesture(controls, rnd.choice(others), rnd)
+        return msgs + [press(control, False)]
+    if kind == "note":
+        if mode == "sweep":
+            return [(port, [0x90+chan, data, v]) for v in sweep(1, 127, rnd)] + \
+                [(port, [0x80+chan, data, 0])]
+        return [press(control, True), press(control, False)]
+    if kind == "kp":
+        return [(port, [0xa0+chan, data, v]) for v in sweep(0, 127, rnd)]
+    if kind == "cc":
+        if mode == "enc":
+            # relative encoder, sign bit encoding
+            v = rnd.choice((1, 65))
+            return [(port, [0xb0+chan, data, v])]*rnd.randint(1, 8)
+        if mode == "key":
+            return [press(control, True), press(control, False)]
+        return [(port, [0xb0+chan, data, v]) for v in sweep(0, 127, rnd)]
+    if kind == "pc":
+        return [(port, [0xc0+chan, data])]
+    if kind == "cp":
+        return [(port, [0xd0+chan, v]) for v in sweep(0, 127, rnd)]
+    if kind == "pb":
+        return [(port, [0xe0+chan, v & 0x7f, v >> 7]) for v in sweep(0, 16383, rnd)]
+
+def varlen(n):
+    b = [n & 0x7f]
+    while n > 0x7f:
+        n >>= 7
+        b.insert(0, 0x80 | (n & 0x7f))
+    return bytes(b)
+
+def track(port, events):
+    data = varlen(0) + bytes([0xff, 0x21, 1, port])
+    t = 0
+    for time, msg in events:
+        data += varlen(time-t) + bytes(msg)
+        t = time
+    data += varlen(0) + bytes([0xff, 0x2f, 0])
+    return b"MTrk" + struct.pack(">I", len(data)) + data
+
+def main():
+    if len(sys.argv) != 3:
+        sys.exit("usage: %s config.midizaprc output.mid" % sys.argv[0])
+    config, output = sys.argv[1:]
+    controls = parse(config)
+    if not controls:
+        sys.exit("%s: no MIDI translations found" % config)
+    rnd = random.Random(os.path.basename(config))
+    tracks = ([], [])
+    time, n = 0, 0
+    while n < N_EVENTS:
+        for port, msg in gesture(controls, rnd.choice(controls), rnd):
+            tracks[port].append((time, msg))
+            time += rnd.randint(1, 4)
+            n += 1
+        time += rnd.randint(10, 200)
+    with open(output, "wb") as f:
+        f.write(b"MThd" + struct.pack(">IHHH", 6, 1, 2, DIVISION))
+        for port in (0, 1):
+            f.write(track(port, tracks[port]))
+
+main()
@@ -0,0 +1,120 @@
+#!/bin/sh
+
+# Run the benchmark corpus and compare the results against the baseline.
+# Usage: bench/perf-check.sh [-u]
+# With -u, the throughput baseline is updated with the results instead.
+
+# Each input stream bench/NAME.mid is replayed with the corresponding
+# configuration, examples/NAME.midizaprc (example.midizaprc for the
+# example.mid stream) and the focus script bench/NAME.focus, if there is
+# one, taking the best throughput out of $PERF_RUNS runs
+# (default: 10). The check fails if the throughput drops more than
+# $PERF_THRESHOLD percent (default: 20) below the baseline, or if the number
+# of heap allocations goes up.
+
+# The throughput depends on the machine, so its baseline isn't kept under
+# version control. It is recorded in bench/baseline.local on the first run
+# (or with -u), and there's nothing to compare against until then. The
+# number of allocations, on the other hand, should be the same everywhere,
+# so these are compared against the figures in bench/baseline.
+
+cd "$(dirname "$0")/.."
+
+runs=${PERF_RUNS:-10}
+threshold=${PERF_THRESHOLD:-20}
+baseline=bench/baseline
+local=bench/baseline.local
+update=no
+if [ "$1" = "-u" ]; then update=yes; fi
+
+if [ ! -x ./midizap ] || [ ! -f bench/alloccount.so ]; then
+    echo "perf-check: build midizap and bench/alloccount.so first" >&2
+    exit 2
+fi
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+results=$tmp/results
+
+for input in bench/*.mid; do
+    name=$(basename "$input" .mid)
+    if [ "$name" = example ]; then
+	config=example.midizaprc
+    else
+	config=examples/$name.midizaprc
+    fi
+    # midizap writes a cache file next to the configuration, so we work
+    # on a copy to keep the source tree clean
+    cp "$config" "$tmp/" || exit 2
+    config=$tmp/$(basename "$config")
+    focus=
+    if [ -f bench/$name.focus ]; then focus="--focus bench/$name.focus"; fi
+    best=0
+    allocs=
+    i=0
+    while [ $i -lt $runs ]; do
+	out=$(LD_PRELOAD=./bench/alloccount.so ./midizap --replay "$input" $focus --out /dev/null "$config" 2>&1 >/dev/null)
+	rate=$(echo "$out" | sed -n 's/.*(\([0-9]*\) events\/s).*/\1/p')
+	n=$(echo "$out" | sed -n 's/^\([0-9]*\) heap allocations$/\1/p')
+	if [ -z "$rate" ] || [ -z "$n" ]; then
+	    echo "$name: replay failed:" >&2
+	    echo "$out" >&2
+	    exit 2
+	fi
+	if [ "$rate" -gt "$best" ]; then best=$rate; fi
+	# the allocation count should be the same in each run, but take the
+	# maximum just in case
+	if [ -z "$allocs" ] || [ "$n" -gt "$allocs" ]; then allocs=$n; fi
+	i=$((i+1))
+    done
+    echo "$name $best $allocs" >> "$results"
+done
+
+rates=$local
+if [ $update = yes ] || [ ! -f $local ]; then
+    if [ $update = no ]; then
+	echo "perf-check: no throughput baseline yet, recording one in $local"
+	rates=/dev/null
+    fi
+    {
+	echo "# name events/s (written by bench/perf-check.sh)"
+	cut -d' ' -f1,2 "$results"
+    } > $local
+    if [ $update = yes ]; then
+	cat "$results"
+	echo "baseline updated"
+	exit 0
+    fi
+fi
+
+awk -v threshold=$threshold '
+FILENAME == ARGV[1] {
+    if ($1 !~ /^#/) base_allocs[$1] = $2
+    next
+}
+FILENAME == ARGV[2] {
+    if ($1 !~ /^#/) base_rate[$1] = $2
+    next
+}
+{
+    name = $1; rate = $2; allocs = $3
+    # all allocation counts should be zero, so that is the default
+    status = allocs > base_allocs[name] ? "MORE ALLOCS" : "ok"
+    if (name in base_rate) {
+	change = (rate - base_rate[name]) * 100.0 / base_rate[name]
+	if (change < -threshold)
+	    status = (status == "ok" ? "" : status ",") "SLOWER"
+	printf "%-14s %9d events/s (%+6.1f%%) %6d allocs (baseline %d)  %s\n",
+	    name, rate, change, allocs, base_allocs[name], status
+    } else
+	printf "%-14s %9d events/s (no baseline) %6d allocs (baseline %d)  %s\n",
+	    name, rate, allocs, base_allocs[name], status
+    if (status != "ok") failed++
+}
+END {
+    if (failed) {
+	printf "perf-check: %d regression%s (threshold %d%%)\n",
+	    failed, (failed > 1 ? "s" : ""), threshold
+	exit 1
+    }
+}' $baseline $rates "$results"
@@ -0,0 +1,108 @@
+
+/*
+
+  Reload stress test (make reload-check).
+
+  Usage: bench/reload-check count rcfile config...
+
+  This reloads a configuration count times, the same way as midizap does
+  when the configuration file changes: the new configuration is parsed in
+  the background, then installed, and the old one is freed. Each time
+  around, rcfile is overwritten with the next one of the given
+  configurations. Every other time, a comment with the iteration number is
+  appended, so that the configuration has to be parsed anew instead of
+  coming from the cache.
+
+  The resident set size is measured after the first round through the
+  configurations (when the memory allocator has settled down) and at the
+  end, and both figures are printed in kB on stdout. The script
+  bench/reload-check.sh checks that the difference stays within bounds.
+
+*/
+
+// Pull in midizap itself, so that we get all of its global state.
+#define main midizap_main
+#include "../midizap.c"
+#undef main
+
+#include <utime.h>
+
+static long rss(void)
+{
+  long size, resident = 0;
+  FILE *fp = fopen("/proc/self/statm", "r");
+  if (fp) {
+    if (fscanf(fp, "%ld %ld", &size, &resident) != 2) resident = 0;
+    fclose(fp);
+  }
+  return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static char *read_file(char *name, size_t *len)
+{
+  FILE *fp = fopen(name, "r");
+  char *buf;
+  long n;
+  if (!fp) { perror(name); exit(2); }
+  fseek(fp, 0, SEEK_END);
+  n = ftell(fp);
+  rewind(fp);
+  buf = malloc(n);
+  if (!buf || fread(buf, 1, n, fp) != (size_t)n) {
+    perror(name); exit(2);
+  }
+  fclose(fp);
+  *len = n;
+  return buf;
+}
+
+int main(int argc, char **argv)
+{
+  int i, n, n_configs, reload_fd;
+  char **configs;
+  size_t *lens;
+  long start = 0;
+
+  if (argc < 4 || (n = atoi(argv[1])) <= 0) {
+    fprintf(stderr, "usage: %s count rcfile config...\n", argv[0]);
+    exit(2);
+  }
+  config_file_name = argv[2];
+  n_configs = argc-3;
+  configs = calloc(n_configs, sizeof(char*));
+  lens = calloc(n_configs, sizeof(size_t));
+  for (i = 0; i < n_configs; i++)
+    configs[i] = read_file(argv[i+3], &lens[i]);
+
+  reload_fd = init_config_reload();
+  if (reload_fd < 0) exit(2);
+  for (i = 0; i < n; i++) {
+    FILE *fp = fopen(config_file_name, "w");
+    struct utimbuf t;
+    struct pollfd pfd = { reload_fd, POLLIN, 0 };
+    if (!fp) { perror(config_file_name); exit(2); }
+    fwrite(configs[i%n_configs], 1, lens[i%n_configs], fp);
+    if (i/n_configs%2) fprintf(fp, "\n# reload %d\n", i);
+    fclose(fp);
+    // midizap only looks at the modification time, which has a resolution
+    // of one second, so make sure that it goes up each time
+    t.actime = t.modtime = i+1;
+    if (utime(config_file_name, &t) < 0) {
+      perror(config_file_name); exit(2);
+    }
+    if (i == 0) {
+      // the initial load is synchronous
+      if (!read_config_file()) exit(1);
+    } else {
+      if (reload_config_file()) continue;
+      if (poll(&pfd, 1, -1) < 0) { perror("poll"); exit(2); }
+      if (!finish_config_reload()) {
+	fprintf(stderr, "%s: reload %d failed\n", argv[0], i);
+	exit(1);
+      }
+    }
+    if (i == 2*n_configs-1) start = rss();
+  }
+  printf("%ld %ld\n", start, rss());
+  return 0;
+}
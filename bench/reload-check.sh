@@ -0,0 +1,43 @@
+#!/bin/sh
+
+# Check that reloading the configuration doesn't leak memory.
+# Usage: bench/reload-check.sh
+
+# This runs bench/reload-check, which reloads a configuration $RELOAD_COUNT
+# times (default: 5000), cycling through example.midizaprc and the
+# configurations in the examples folder, and fails if the resident set size
+# grows by more than $RELOAD_RSS_LIMIT kB (default: 1024) in the process.
+# The configuration file (along with its cache file) lives in a temporary
+# directory, so that nothing gets written to the source tree.
+
+cd "$(dirname "$0")/.."
+
+count=${RELOAD_COUNT:-5000}
+limit=${RELOAD_RSS_LIMIT:-1024}
+
+if [ ! -x bench/reload-check ]; then
+    echo "reload-check: build bench/reload-check first" >&2
+    exit 2
+fi
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# The example configurations define different Jack ports, which midizap
+# complains about on each reload, so the error messages are only shown if
+# something goes wrong.
+out=$(bench/reload-check $count "$tmp/midizaprc" example.midizaprc examples/*.midizaprc 2>"$tmp/errors")
+status=$?
+if [ $status -ne 0 ] || [ -z "$out" ]; then
+    sort -u "$tmp/errors" >&2
+    echo "reload-check: reload failed" >&2
+    exit 2
+fi
+
+set -- $out
+growth=$(($2-$1))
+echo "$count reloads: RSS $1 kB -> $2 kB ($growth kB, limit $limit kB)"
+if [ $growth -gt $limit ]; then
+    echo "reload-check: memory leak?"
+    exit 1
+fi
@@ -0,0 +1,169 @@
+
+/*
+
+  Read-back test for the uinput output (make uinput-check).
+
+  Usage: bench/uinput-check
+
+  This creates midizap's virtual input device, the same way as midizap -u
+  does, then feeds a few MIDI notes through the translations below and
+  checks that the expected key, button and wheel events come out at the
+  other end, by reading them back from the device's /dev/input/eventN
+  node. If /dev/uinput or the event node can't be opened (usually this
+  needs root, or membership in the input group), the test is skipped.
+
+*/
+
+// Pull in midizap itself, so that we get all of its global state.
+#define main midizap_main
+#include "../midizap.c"
+#undef main
+
+#include <dirent.h>
+#include <errno.h>
+
+static const char *config =
+  "[Default]\n"
+  "C5 XK_a\n"
+  "D5 XK_Shift_L/D \"bc\"\n"
+  "E5 XK_Control_L/D XK_x XK_Control_L/U XK_Return RELEASE XK_Tab\n"
+  "F5 XK_Button_1\n"
+  "G5 XK_Scroll_Up\n";
+
+// the notes to play (each is pressed and released)
+static const int notes[] = { 60, 62, 64, 65, 67 };
+
+// what we expect to read back (sans the SYN_REPORTs)
+static const struct { int type, code, value; } expected[] = {
+  { EV_KEY, KEY_A, 1 }, { EV_KEY, KEY_A, 0 },
+  { EV_KEY, KEY_LEFTSHIFT, 1 },
+  { EV_KEY, KEY_B, 1 }, { EV_KEY, KEY_B, 0 },
+  { EV_KEY, KEY_C, 1 }, { EV_KEY, KEY_LEFTSHIFT, 0 }, { EV_KEY, KEY_C, 0 },
+  { EV_KEY, KEY_LEFTCTRL, 1 }, { EV_KEY, KEY_X, 1 },
+  { EV_KEY, KEY_LEFTCTRL, 0 }, { EV_KEY, KEY_X, 0 },
+  { EV_KEY, KEY_ENTER, 1 }, { EV_KEY, KEY_ENTER, 0 },
+  { EV_KEY, KEY_TAB, 1 }, { EV_KEY, KEY_TAB, 0 },
+  { EV_KEY, BTN_LEFT, 1 }, { EV_KEY, BTN_LEFT, 0 },
+  { EV_REL, REL_WHEEL, 1 },
+};
+#define N_EXPECTED (int)(sizeof(expected)/sizeof(expected[0]))
+
+static void skip(const char *msg)
+{
+  printf("uinput-check: %s, skipped\n", msg);
+  exit(0);
+}
+
+// Find the event node of our device. There might be other midizap
+// instances running, so we take the one which was created last, i.e., the
+// one with the highest input number.
+static int find_event_node(char *path)
+{
+  DIR *dir = opendir("/sys/class/input");
+  struct dirent *d;
+  int best = -1, event = -1;
+  if (!dir) return 0;
+  while ((d = readdir(dir))) {
+    char name[PATH_MAX], buf[256], link[PATH_MAX], *s;
+    ssize_t n;
+    int k, input;
+    FILE *fp;
+    if (sscanf(d->d_name, "event%d", &k) != 1) continue;
+    snprintf(name, sizeof(name), "/sys/class/input/%s/device/name", d->d_name);
+    if (!(fp = fopen(name, "r"))) continue;
+    if (!fgets(buf, sizeof(buf), fp)) *buf = 0;
+    fclose(fp);
+    if (strcmp(buf, "midizap\n")) continue;
+    snprintf(name, sizeof(name), "/sys/class/input/%s/device", d->d_name);
+    if ((n = readlink(name, link, sizeof(link)-1)) < 0) continue;
+    link[n] = 0;
+    if (!(s = strrchr(link, '/')) || sscanf(s, "/input%d", &input) != 1)
+      continue;
+    if (input > best) {
+      best = input;
+      event = k;
+    }
+  }
+  closedir(dir);
+  if (event < 0) return 0;
+  sprintf(path, "/dev/input/event%d", event);
+  return 1;
+}
+
+int main(void)
+{
+  char rcname[] = "/tmp/uinput-check-XXXXXX", path[64];
+  struct input_event ev;
+  int fd, i, n, failed = 0;
+  FILE *fp;
+
+  if ((fd = open("/dev/uinput", O_WRONLY)) < 0)
+    skip("can't open /dev/uinput");
+  close(fd);
+  use_uinput = 1;
+  if (!init_uinput()) {
+    fprintf(stderr, "uinput-check: unable to create uinput device\n");
+    exit(1);
+  }
+  // udev may take a moment to create the event node
+  fd = -1;
+  for (i = 0; i < 100 && fd < 0; i++) {
+    if (find_event_node(path)) fd = open(path, O_RDONLY|O_NONBLOCK);
+    if (fd < 0) usleep(20000);
+  }
+  if (fd < 0) {
+    close_uinput();
+    skip("can't open the event node of the uinput device");
+  }
+
+  // the configuration goes into a temporary file
+  if ((n = mkstemp(rcname)) < 0 || !(fp = fdopen(n, "w"))) {
+    perror(rcname);
+    exit(2);
+  }
+  fputs(config, fp);
+  fclose(fp);
+  config_file_name = rcname;
+  if (!read_config_file()) exit(2);
+  unlink(rcname);
+
+  init_output();
+  for (i = 0; i < (int)(sizeof(notes)/sizeof(notes[0])); i++) {
+    uint8_t on[3] = { 0x90, notes[i], 100 }, off[3] = { 0x80, notes[i], 0 };
+    handle_event(on, 0, 0, 0);
+    handle_event(off, 0, 0, 0);
+    flush_keys();
+  }
+  // this waits for the output thread to finish
+  close_output();
+
+  n = 0;
+  while (n < N_EXPECTED) {
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    if (read(fd, &ev, sizeof(ev)) != sizeof(ev)) {
+      if (errno == EAGAIN && poll(&pfd, 1, 1000) > 0) continue;
+      break;
+    }
+    if (ev.type == EV_SYN) continue;
+    if (ev.type != expected[n].type || ev.code != expected[n].code ||
+	ev.value != expected[n].value) {
+      printf("event %d: got type %d code %d value %d, expected %d %d %d\n",
+	     n, ev.type, ev.code, ev.value,
+	     expected[n].type, expected[n].code, expected[n].value);
+      failed++;
+    }
+    n++;
+  }
+  close(fd);
+  close_uinput();
+  if (n < N_EXPECTED) {
+    printf("uinput-check: got %d events, expected %d\n", n, N_EXPECTED);
+    exit(1);
+  }
+  if (failed) {
+    printf("uinput-check: %d wrong event%s\n", failed, failed > 1 ? "s" : "");
+    exit(1);
+  }
+  printf("uinput-check: %d events ok\n", n);
+  return 0;
+}
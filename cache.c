@@ -0,0 +1,475 @@
+
+/*
+
+  Binary cache of compiled configurations.
+
+  After a config file has been parsed without errors, the resulting
+  translation set is written to <rcfile>.cache as a relocatable image, with
+  all pointers replaced by offsets from the start of the image. When the
+  same config file is loaded again, the image is simply mapped into memory
+  and the pointers get relocated, so that we don't have to go through the
+  parser again. Only the section regexes need to be recompiled.
+
+  The cache is keyed by the size and a hash of the text of the config file,
+  and it also records the layout of the data structures and the command line
+  options affecting the result, so a stale or incompatible cache will never
+  be used. In that case we just fall back to parsing the file.
+
+  The sections of a set loaded from the cache live in the mapped image, and
+  may outlive the set itself when they are taken over by the next set on
+  reload. Therefore the image is reference-counted, and it gets unmapped when
+  the set and all of its sections are gone.
+
+*/
+
+#include "midizap.h"
+
+#define CACHE_MAGIC "MZCACHE1"
+
+typedef struct {
+  char magic[8];
+  // layout of the data structures, so that we won't use a cache written by
+  // an incompatible build
+  uint32_t layout[6];
+  // size and hash of the config file
+  uint64_t rc_size, rc_hash;
+  // command line options affecting the parse
+  uint32_t flags;
+  // size and hash of the image following the header
+  uint64_t image_size, image_hash;
+} cache_header;
+
+// the image starts at a suitably aligned offset after the header
+#define ALIGNMENT sizeof(max_align_t)
+#define ALIGN(n) (((n) + ALIGNMENT - 1) & ~(ALIGNMENT - 1))
+#define IMAGE_OFFSET ALIGN(sizeof(cache_header))
+
+struct _config_image {
+  char *base;
+  size_t size;
+  int refs;
+};
+
+// 64 bit FNV-1a hash
+uint64_t
+hash_bytes(const void *p, size_t n)
+{
+  const unsigned char *s = p;
+  uint64_t h = 0xcbf29ce484222325ULL;
+  while (n--) {
+    h ^= *s++;
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+static void
+get_layout(uint32_t layout[6])
+{
+  layout[0] = sizeof(translation_set);
+  layout[1] = sizeof(translation);
+  layout[2] = sizeof(stroke_data);
+  layout[3] = sizeof(stroke);
+  layout[4] = sizeof(void*);
+  layout[5] = N_SHIFTS;
+}
+
+static uint32_t
+get_flags(void)
+{
+  return default_debug_regex | default_debug_strokes<<1 |
+    default_debug_keys<<2 | default_debug_midi<<3;
+}
+
+static char *
+cache_name(char *name)
+{
+  char *ret = malloc(strlen(name)+7);
+  if (ret) {
+    strcpy(ret, name);
+    strcat(ret, ".cache");
+  }
+  return ret;
+}
+
+// Writing the image. Objects are written bottom-up, i.e., everything an
+// object points to gets written before the object itself, so that we know
+// the offsets when writing the object. Offset 0 is taken by the translation
+// set itself, so a zero offset always denotes a NULL pointer.
+
+typedef struct {
+  char *data;
+  size_t size, alloc;
+  int failed;
+} image;
+
+#define OFS(type, ofs) ((type)(uintptr_t)(ofs))
+
+static size_t
+put(image *img, const void *p, size_t len)
+{
+  size_t ofs = img->size, n = ALIGN(len);
+  if (img->failed) return 0;
+  if (img->size + n > img->alloc) {
+    size_t alloc = img->alloc ? img->alloc : 65536;
+    char *data;
+    while (img->size + n > alloc) alloc *= 2;
+    data = realloc(img->data, alloc);
+    if (!data) {
+      img->failed = 1;
+      return 0;
+    }
+    img->data = data;
+    img->alloc = alloc;
+  }
+  memset(img->data + ofs, 0, n);
+  if (p) memcpy(img->data + ofs, p, len);
+  img->size += n;
+  return ofs;
+}
+
+static size_t
+put_string(image *img, char *s)
+{
+  return s ? put(img, s, strlen(s)+1) : 0;
+}
+
+static size_t
+put_steps(image *img, int n_steps, int *steps)
+{
+  return steps && n_steps ? put(img, steps, n_steps*sizeof(int)) : 0;
+}
+
+static size_t
+put_strokes(image *img, stroke *s)
+{
+  stroke c;
+
+  if (!s) return 0;
+  c = *s;
+  c.next = OFS(stroke*, put_strokes(img, s->next));
+  c.steps = OFS(int*, put_steps(img, s->n_steps, s->steps));
+  // runtime state, this gets initialized when loading
+  c.keycode = 0;
+  c.d = c.v = 0;
+  c.dirty = 0;
+  if (c.change) c.change = 1;
+  return put(img, &c, sizeof(stroke));
+}
+
+static stroke_data *
+put_stroke_data(image *img, stroke_data *sd, uint16_t n)
+{
+  stroke_data *c;
+  size_t ofs;
+  int i, index;
+
+  if (!sd || !n) return NULL;
+  c = malloc(n*sizeof(stroke_data));
+  if (!c) {
+    img->failed = 1;
+    return NULL;
+  }
+  memcpy(c, sd, n*sizeof(stroke_data));
+  for (i = 0; i < n; i++) {
+    for (index = 0; index < 2; index++) {
+      c[i].s[index] = OFS(stroke*, put_strokes(img, sd[i].s[index]));
+      c[i].steps[index] =
+	OFS(int*, put_steps(img, sd[i].n_steps[index], sd[i].steps[index]));
+    }
+  }
+  ofs = put(img, c, n*sizeof(stroke_data));
+  free(c);
+  return OFS(stroke_data*, ofs);
+}
+
+static size_t
+put_section(image *img, translation *tr)
+{
+  translation t;
+  int k;
+
+  t = *tr;
+  t.name = OFS(char*, put_string(img, tr->name));
+  t.pattern = OFS(char*, put_string(img, tr->pattern));
+  memset(&t.regex, 0, sizeof(regex_t));
+  for (k=0; k<N_SHIFTS+1; k++) {
+    t.pc[k] = put_stroke_data(img, tr->pc[k], tr->n_pc[k]);
+    t.note[k] = put_stroke_data(img, tr->note[k], tr->n_note[k]);
+    t.notes[k] = put_stroke_data(img, tr->notes[k], tr->n_notes[k]);
+    t.cc[k] = put_stroke_data(img, tr->cc[k], tr->n_cc[k]);
+    t.ccs[k] = put_stroke_data(img, tr->ccs[k], tr->n_ccs[k]);
+    t.pb[k] = put_stroke_data(img, tr->pb[k], tr->n_pb[k]);
+    t.pbs[k] = put_stroke_data(img, tr->pbs[k], tr->n_pbs[k]);
+    t.kp[k] = put_stroke_data(img, tr->kp[k], tr->n_kp[k]);
+    t.kps[k] = put_stroke_data(img, tr->kps[k], tr->n_kps[k]);
+    t.cp[k] = put_stroke_data(img, tr->cp[k], tr->n_cp[k]);
+    t.cps[k] = put_stroke_data(img, tr->cps[k], tr->n_cps[k]);
+  }
+  t.errors = 0;
+  t.refs = 0;
+  t.mem.chunks = NULL;
+  t.mem.size = 0;
+  t.image = NULL;
+  return put(img, &t, sizeof(translation));
+}
+
+void
+save_config_cache(char *name, size_t len, uint64_t hash, translation_set *ts)
+{
+  image img = { NULL, 0, 0, 0 };
+  translation_set c;
+  translation **sections = NULL;
+  cache_header hdr;
+  char *cname = cache_name(name), *tmpname = NULL;
+  FILE *f = NULL;
+  int i;
+
+  if (!cname) return;
+  if (ts->n_sections &&
+      !(sections = malloc(ts->n_sections*sizeof(translation*))))
+    goto out;
+  // reserve room for the set, which goes first
+  put(&img, NULL, sizeof(translation_set));
+  c = *ts;
+  c.default_translation = NULL;
+  c.default_midi_translation[0] = c.default_midi_translation[1] = NULL;
+  for (i = 0; i < ts->n_sections; i++) {
+    translation *tr = ts->sections[i];
+    sections[i] = OFS(translation*, put_section(&img, tr));
+    // fix up the pointers in the set referring to this section
+    if (tr == ts->default_translation)
+      c.default_translation = sections[i];
+    if (tr == ts->default_midi_translation[0])
+      c.default_midi_translation[0] = sections[i];
+    if (tr == ts->default_midi_translation[1])
+      c.default_midi_translation[1] = sections[i];
+  }
+  c.sections = OFS(translation**, put(&img, sections,
+				      ts->n_sections*sizeof(translation*)));
+  c.a_sections = c.n_sections;
+  c.jack_client_name = OFS(char*, put_string(&img, ts->jack_client_name));
+  for (int k = 0; k < 2; k++) {
+    c.jack_in_regex[k] = OFS(char*, put_string(&img, ts->jack_in_regex[k]));
+    c.jack_out_regex[k] = OFS(char*, put_string(&img, ts->jack_out_regex[k]));
+  }
+  c.mem.chunks = NULL;
+  c.mem.size = 0;
+  c.image = NULL;
+  if (img.failed) goto out;
+  memcpy(img.data, &c, sizeof(translation_set));
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, CACHE_MAGIC, 8);
+  get_layout(hdr.layout);
+  hdr.rc_size = len;
+  hdr.rc_hash = hash;
+  hdr.flags = get_flags();
+  hdr.image_size = img.size;
+  hdr.image_hash = hash_bytes(img.data, img.size);
+
+  // Write to a temporary file first, so that nobody ever gets to see a
+  // partially written cache. Failure to write the cache isn't an error, the
+  // directory may well be read-only.
+  tmpname = malloc(strlen(cname)+16);
+  if (!tmpname) goto out;
+  sprintf(tmpname, "%s.%d", cname, (int)getpid());
+  f = fopen(tmpname, "wb");
+  if (!f) goto out;
+  {
+    static const char pad[ALIGNMENT];
+    if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+	fwrite(pad, IMAGE_OFFSET-sizeof(hdr), 1, f) != 1 ||
+	fwrite(img.data, img.size, 1, f) != 1) {
+      fclose(f);
+      unlink(tmpname);
+      goto out;
+    }
+  }
+  if (fclose(f) || rename(tmpname, cname))
+    unlink(tmpname);
+ out:
+  free(tmpname);
+  free(cname);
+  free(sections);
+  free(img.data);
+}
+
+// Loading the image. Every pointer is checked before being relocated: the
+// object (or array of objects) it points to must be properly aligned and lie
+// within the image, and strings must be terminated within the image. The
+// image hash should have caught any corruption by then already, but we'd
+// rather not crash on a bad cache file.
+
+#define RELOC_N(p, n)						\
+  do {								\
+    if (p) {							\
+      uintptr_t ofs = (uintptr_t)(p);				\
+      if (ofs % __alignof__(*(p)) || ofs > size ||		\
+	  (size_t)(n) > (size - ofs) / sizeof(*(p)))		\
+	return 0;						\
+      (p) = (void*)(base + ofs);				\
+    }								\
+  } while (0)
+
+#define RELOC(p) RELOC_N(p, 1)
+
+#define RELOC_STR(p)						\
+  do {								\
+    if (p) {							\
+      uintptr_t ofs = (uintptr_t)(p);				\
+      if (ofs >= size || !memchr(base + ofs, 0, size - ofs))	\
+	return 0;						\
+      (p) = base + ofs;						\
+    }								\
+  } while (0)
+
+static int
+reloc_strokes(char *base, size_t size, stroke *s)
+{
+  for (; s; s = s->next) {
+    if (s->n_steps < 0) return 0;
+    RELOC_N(s->steps, s->n_steps);
+    // The strokes of a sequence are written back to front (see
+    // put_strokes()), so the offsets go down as we follow the chain. This
+    // also makes sure that we don't go around in circles.
+    if (s->next && (uintptr_t)s->next >= (uintptr_t)((char*)s - base))
+      return 0;
+    RELOC(s->next);
+  }
+  return 1;
+}
+
+static int
+reloc_stroke_data(char *base, size_t size, stroke_data **sdp, uint16_t n)
+{
+  stroke_data *sd;
+  int i, index;
+
+  RELOC_N(*sdp, n);
+  sd = *sdp;
+  if (!sd) return 1;
+  for (i = 0; i < n; i++) {
+    for (index = 0; index < 2; index++) {
+      if (sd[i].n_steps[index] < 0) return 0;
+      RELOC_N(sd[i].steps[index], sd[i].n_steps[index]);
+      RELOC(sd[i].s[index]);
+      if (!reloc_strokes(base, size, sd[i].s[index])) return 0;
+    }
+  }
+  return 1;
+}
+
+static int
+reloc_set(char *base, size_t size, translation_set *ts)
+{
+  translation *tr;
+  int i, k;
+
+  if (ts->n_sections < 0) return 0;
+  RELOC_N(ts->sections, ts->n_sections);
+  if (ts->n_sections && !ts->sections) return 0;
+  RELOC(ts->default_translation);
+  RELOC(ts->default_midi_translation[0]);
+  RELOC(ts->default_midi_translation[1]);
+  RELOC_STR(ts->jack_client_name);
+  for (k = 0; k < 2; k++) {
+    RELOC_STR(ts->jack_in_regex[k]);
+    RELOC_STR(ts->jack_out_regex[k]);
+  }
+  for (i = 0; i < ts->n_sections; i++) {
+    RELOC(ts->sections[i]);
+    tr = ts->sections[i];
+    if (!tr) return 0;
+    RELOC_STR(tr->name);
+    RELOC_STR(tr->pattern);
+    for (k=0; k<N_SHIFTS+1; k++) {
+      if (!reloc_stroke_data(base, size, &tr->pc[k], tr->n_pc[k]) ||
+	  !reloc_stroke_data(base, size, &tr->note[k], tr->n_note[k]) ||
+	  !reloc_stroke_data(base, size, &tr->notes[k], tr->n_notes[k]) ||
+	  !reloc_stroke_data(base, size, &tr->cc[k], tr->n_cc[k]) ||
+	  !reloc_stroke_data(base, size, &tr->ccs[k], tr->n_ccs[k]) ||
+	  !reloc_stroke_data(base, size, &tr->pb[k], tr->n_pb[k]) ||
+	  !reloc_stroke_data(base, size, &tr->pbs[k], tr->n_pbs[k]) ||
+	  !reloc_stroke_data(base, size, &tr->kp[k], tr->n_kp[k]) ||
+	  !reloc_stroke_data(base, size, &tr->kps[k], tr->n_kps[k]) ||
+	  !reloc_stroke_data(base, size, &tr->cp[k], tr->n_cp[k]) ||
+	  !reloc_stroke_data(base, size, &tr->cps[k], tr->n_cps[k]))
+	return 0;
+    }
+  }
+  return 1;
+}
+
+translation_set *
+load_config_cache(char *name, size_t len, uint64_t hash)
+{
+  char *cname = cache_name(name);
+  struct stat st;
+  cache_header *hdr;
+  uint32_t layout[6];
+  translation_set *ts;
+  config_image *img;
+  char *base;
+  int fd, i;
+
+  if (!cname) return NULL;
+  fd = open(cname, O_RDONLY);
+  free(cname);
+  if (fd < 0) return NULL;
+  if (fstat(fd, &st) < 0 ||
+      (size_t)st.st_size < IMAGE_OFFSET + sizeof(translation_set)) {
+    close(fd);
+    return NULL;
+  }
+  // We map the file privately, so that we can relocate it in place.
+  base = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) return NULL;
+  hdr = (cache_header*)base;
+  get_layout(layout);
+  if (memcmp(hdr->magic, CACHE_MAGIC, 8) ||
+      memcmp(hdr->layout, layout, sizeof(layout)) ||
+      hdr->rc_size != len || hdr->flags != get_flags() ||
+      hdr->image_size != st.st_size - IMAGE_OFFSET ||
+      hdr->rc_hash != hash ||
+      hdr->image_hash != hash_bytes(base+IMAGE_OFFSET, hdr->image_size))
+    goto fail;
+  ts = (translation_set*)(base+IMAGE_OFFSET);
+  if (!reloc_set(base+IMAGE_OFFSET, hdr->image_size, ts))
+    goto fail;
+  for (i = 0; i < ts->n_sections; i++) {
+    translation *tr = ts->sections[i];
+    if (!tr->is_default &&
+	(!tr->pattern ||
+	 regcomp(&tr->regex, tr->pattern, REG_EXTENDED|REG_NOSUB))) {
+      // shouldn't happen, the cache only has sets which compiled fine
+      while (--i >= 0)
+	if (!ts->sections[i]->is_default) regfree(&ts->sections[i]->regex);
+      goto fail;
+    }
+  }
+  img = malloc(sizeof(config_image));
+  if (!img) goto fail;
+  img->base = base;
+  img->size = st.st_size;
+  // the set and each of its sections hold a reference to the image
+  img->refs = 1 + ts->n_sections;
+  ts->image = img;
+  for (i = 0; i < ts->n_sections; i++) {
+    ts->sections[i]->refs = 1;
+    ts->sections[i]->image = img;
+  }
+  return ts;
+ fail:
+  munmap(base, st.st_size);
+  return NULL;
+}
+
+void
+release_config_image(config_image *img)
+{
+  if (--img->refs > 0) return;
+  munmap(img->base, img->size);
+  free(img);
+}
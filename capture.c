@@ -0,0 +1,165 @@
+
+/*
+
+  Capturing MIDI input to a file (midizap --capture).
+
+  This records everything that arrives on the input ports, along with the
+  window focus changes, in the format described in midizap.h, so that a
+  session can be replayed later with --replay. The Jack thread and the main
+  thread each queue their records in a lock-free ringbuffer of their own,
+  and a writer thread takes care of the file I/O. If a ringbuffer fills up
+  because the writer can't keep up, records are dropped and the number of
+  dropped records is reported when the capture is closed.
+
+*/
+
+#include "midizap.h"
+#include <jack/ringbuffer.h>
+
+// size of each ringbuffer, in bytes
+#define CAPTURE_QUEUE_SIZE 262144
+// how often the writer thread checks the ringbuffers, in usecs
+#define CAPTURE_INTERVAL 20000
+
+static FILE *capture_file = NULL;
+static char *capture_name;
+static jack_ringbuffer_t *midi_queue, *focus_queue;
+static pthread_t capture_thread;
+static int capture_running = 0;
+static volatile int midi_dropped = 0;
+static int focus_dropped = 0;
+
+static void
+queue_record(jack_ringbuffer_t *rb, uint32_t frames, int type, int port,
+	     uint8_t *data, size_t len, volatile int *dropped)
+{
+  capture_record r = { frames, type, port, len };
+  if (len > 0xffff ||
+      jack_ringbuffer_write_space(rb) < sizeof(r)+len) {
+    (*dropped)++;
+    return;
+  }
+  // The reader only takes complete records, so it doesn't matter that this
+  // isn't done in one go.
+  jack_ringbuffer_write(rb, (char*)&r, sizeof(r));
+  jack_ringbuffer_write(rb, (char*)data, len);
+}
+
+// Called in the Jack thread.
+void
+capture_midi(uint8_t port_no, uint32_t frames, uint8_t *msg, size_t len)
+{
+  queue_record(midi_queue, frames, CAPTURE_MIDI, port_no, msg, len,
+	       &midi_dropped);
+}
+
+// Called in the main thread, with the time of the MIDI message which
+// prompted the focus check.
+void
+capture_focus(uint32_t frames, char *win_class, char *win_title)
+{
+  char buf[2*1024];
+  size_t l, l2;
+  if (!capture_file) return;
+  l = strlen(win_class)+1; l2 = strlen(win_title)+1;
+  if (l+l2 > sizeof(buf)) {
+    focus_dropped++;
+    return;
+  }
+  memcpy(buf, win_class, l);
+  memcpy(buf+l, win_title, l2);
+  queue_record(focus_queue, frames, CAPTURE_FOCUS, 0, (uint8_t*)buf, l+l2,
+	       &focus_dropped);
+}
+
+// Write all complete records in the given ringbuffer to the file.
+static void
+write_records(jack_ringbuffer_t *rb)
+{
+  capture_record r;
+  char buf[4096];
+
+  while (jack_ringbuffer_read_space(rb) >= sizeof(r)) {
+    size_t n;
+    jack_ringbuffer_peek(rb, (char*)&r, sizeof(r));
+    if (jack_ringbuffer_read_space(rb) < sizeof(r)+r.len) break;
+    jack_ringbuffer_read_advance(rb, sizeof(r));
+    fwrite(&r, sizeof(r), 1, capture_file);
+    for (n = r.len; n > 0; ) {
+      size_t k = n < sizeof(buf) ? n : sizeof(buf);
+      jack_ringbuffer_read(rb, buf, k);
+      fwrite(buf, 1, k, capture_file);
+      n -= k;
+    }
+  }
+}
+
+static void *
+capture_thread_proc(void *arg)
+{
+  (void)arg;
+  while (__atomic_load_n(&capture_running, __ATOMIC_ACQUIRE)) {
+    usleep(CAPTURE_INTERVAL);
+    write_records(midi_queue);
+    write_records(focus_queue);
+    fflush(capture_file);
+  }
+  return NULL;
+}
+
+// This needs to be called before the Jack client gets activated, so that
+// no input gets lost.
+int
+init_capture(char *name)
+{
+  capture_file = fopen(name, "wb");
+  if (!capture_file) {
+    perror(name);
+    return 0;
+  }
+  capture_name = name;
+  midi_queue = jack_ringbuffer_create(CAPTURE_QUEUE_SIZE);
+  focus_queue = jack_ringbuffer_create(CAPTURE_QUEUE_SIZE);
+  if (!midi_queue || !focus_queue) {
+    fprintf(stderr, "cannot create capture queue\n");
+    fclose(capture_file);
+    capture_file = NULL;
+    return 0;
+  }
+  jack_ringbuffer_mlock(midi_queue);
+  return 1;
+}
+
+// Write the file header and start the writer thread, once the sample rate
+// is known.
+void
+start_capture(uint32_t rate)
+{
+  capture_header h;
+  if (!capture_file) return;
+  memcpy(h.magic, CAPTURE_MAGIC, 4);
+  h.rate = rate;
+  fwrite(&h, sizeof(h), 1, capture_file);
+  capture_running = 1;
+  if (pthread_create(&capture_thread, NULL, capture_thread_proc, NULL)) {
+    fprintf(stderr, "cannot create capture thread\n");
+    capture_running = 0;
+  }
+}
+
+void
+close_capture(void)
+{
+  if (!capture_file) return;
+  if (capture_running) {
+    __atomic_store_n(&capture_running, 0, __ATOMIC_RELEASE);
+    pthread_join(capture_thread, NULL);
+  }
+  write_records(midi_queue);
+  write_records(focus_queue);
+  if (midi_dropped || focus_dropped)
+    fprintf(stderr, "%s: %d records dropped\n", capture_name,
+	    midi_dropped+focus_dropped);
+  fclose(capture_file);
+  capture_file = NULL;
+}
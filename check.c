@@ -0,0 +1,317 @@
+
+/*
+
+  Checking a configuration without running it (midizap -c, --check).
+
+  This loads the config file just like at startup, but without connecting
+  to the X server or Jack. Any errors in the file are reported as usual,
+  along with warnings about things which are legal but most likely not what
+  was intended (macro calls which can't be resolved, sections and rules
+  which can never be reached). We also print the number of translations in
+  each section and shift layer, the memory used by each section, and the
+  time spent in the different phases of loading the file.
+
+*/
+
+#include "midizap.h"
+
+// The different kinds of stroke data in a section (N_KINDS is defined in
+// midizap.h).
+
+static const char *kind_names[N_KINDS] = {
+  "note", "notes", "pc", "cc", "ccs", "pb", "pbs", "kp", "kps", "cp", "cps"
+};
+
+stroke_data *
+get_stroke_data(translation *tr, int kind, int k, uint16_t *n)
+{
+  switch (kind) {
+  case 0: *n = tr->n_note[k]; return tr->note[k];
+  case 1: *n = tr->n_notes[k]; return tr->notes[k];
+  case 2: *n = tr->n_pc[k]; return tr->pc[k];
+  case 3: *n = tr->n_cc[k]; return tr->cc[k];
+  case 4: *n = tr->n_ccs[k]; return tr->ccs[k];
+  case 5: *n = tr->n_pb[k]; return tr->pb[k];
+  case 6: *n = tr->n_pbs[k]; return tr->pbs[k];
+  case 7: *n = tr->n_kp[k]; return tr->kp[k];
+  case 8: *n = tr->n_kps[k]; return tr->kps[k];
+  case 9: *n = tr->n_cp[k]; return tr->cp[k];
+  default: *n = tr->n_cps[k]; return tr->cps[k];
+  }
+}
+
+static stroke_data *
+find_entry(stroke_data *sd, uint16_t n, int chan, int data)
+{
+  uint16_t i;
+  for (i = 0; i < n; i++)
+    if (sd[i].chan == chan && sd[i].data == data)
+      return &sd[i];
+  return NULL;
+}
+
+// The other kind of translation (key vs. incremental) of the same message,
+// which takes priority over a default rule in a shift state.
+static const int partner[N_KINDS] = { 1, 0, -1, 4, 3, 6, 5, 8, 7, 10, 9 };
+
+// Look up a message in a shift state the same way as midizap does at
+// runtime, i.e., falling back to the default rules in the unshifted state.
+static stroke_data *
+lookup_entry(translation *tr, int kind, int k, int chan, int data)
+{
+  stroke_data *sd, *def;
+  uint16_t n;
+
+  sd = get_stroke_data(tr, kind, k, &n);
+  sd = find_entry(sd, n, chan, data);
+  if (k == 0 || (sd && sd->s[0])) return sd;
+  if (partner[kind] >= 0) {
+    stroke_data *sdx = get_stroke_data(tr, partner[kind], k, &n);
+    if (find_entry(sdx, n, chan, data)) return sd;
+  }
+  def = get_stroke_data(tr, kind, 0, &n);
+  def = find_entry(def, n, chan, data);
+  return def && def->anyshift ? def : sd;
+}
+
+static int warnings = 0;
+
+static void
+warning(const char *fmt, ...)
+{
+  va_list ap;
+  fprintf(stderr, "warning: ");
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+  warnings++;
+}
+
+static char *
+message_name(char *buf, int status, int chan, int data, int octave)
+{
+  static char *note_names[] = { "C", "C#", "D", "Eb", "E", "F", "F#", "G", "G#", "A", "Bb", "B" };
+  switch (status) {
+  case 0x90:
+    sprintf(buf, "%s%d-%d", note_names[data%12], data/12+octave, chan+1);
+    break;
+  case 0xa0:
+    sprintf(buf, "KP:%s%d-%d", note_names[data%12], data/12+octave, chan+1);
+    break;
+  case 0xb0:
+    sprintf(buf, "%s%d-%d", data>=128?"M":"CC", data%128, chan+1);
+    break;
+  case 0xc0:
+    sprintf(buf, "PC%d-%d", data, chan+1);
+    break;
+  case 0xd0:
+    sprintf(buf, "CP-%d", chan+1);
+    break;
+  case 0xe0:
+    sprintf(buf, "PB-%d", chan+1);
+    break;
+  default:
+    sprintf(buf, "??");
+    break;
+  }
+  return buf;
+}
+
+// Check whether a macro call can be resolved in the given section. At
+// runtime, the macro is looked up in the section of the focused window,
+// then in the default sections, just like any other message.
+static int
+has_macro(translation *tr, int k, int status, int chan, int data)
+{
+  stroke_data *sd;
+  int kind;
+
+  switch (status) {
+  case 0x90: kind = 0; break;
+  case 0xb0: kind = 3; break;
+  case 0xe0: kind = 5; data = 0; break;
+  case 0xa0: kind = 7; break;
+  case 0xd0: kind = 9; data = 0; break;
+  default: return 0; // no mod translations for these
+  }
+  sd = lookup_entry(tr, kind, k, chan, data);
+  return sd && sd->mod && sd->s[0];
+}
+
+static void
+check_macros(translation_set *ts, translation *tr)
+{
+  translation *trs[3] = { tr, ts->default_midi_translation[tr->portno],
+			  ts->default_translation };
+  char buf[32];
+  int k, kind, index, j;
+  uint16_t i, n;
+
+  for (k = 0; k < N_ST; k++) {
+    for (kind = 0; kind < N_KINDS; kind++) {
+      stroke_data *sd = get_stroke_data(tr, kind, k, &n);
+      for (i = 0; i < n; i++) {
+	for (index = 0; index < 2; index++) {
+	  stroke *s;
+	  for (s = sd[i].s[index]; s; s = s->next) {
+	    int status = s->status & 0xf0, chan = s->status & 0x0f;
+	    // In a mod translation, the data byte gets transposed by the
+	    // quotient, which is 0 for the smallest input values.
+	    int data = s->data + (sd[i].mod && sd[i].n_steps[index] ?
+				  sd[i].steps[index][0] : 0);
+	    if (!s->recursive) continue;
+	    for (j = 0; j < 3; j++) {
+	      if (trs[j] && trs[j]->portno == tr->portno &&
+		  has_macro(trs[j], k, status, chan, data))
+		break;
+	    }
+	    if (j == 3) {
+	      char prefix[10] = "";
+	      if (k) sprintf(prefix, "%d^", k);
+	      warning("[%s]: undefined macro $%s%s\n", tr->name, prefix,
+		      message_name(buf, status, chan, data, ts->midi_octave));
+	    }
+	  }
+	}
+      }
+    }
+  }
+}
+
+// Sections which are shadowed by an earlier section with the same regex,
+// and default sections which are replaced by a later one, are never used.
+static void
+check_sections(translation_set *ts)
+{
+  int i, j;
+
+  for (i = 0; i < ts->n_sections; i++) {
+    translation *tr = ts->sections[i];
+    if (tr->is_default) {
+      if (tr != ts->default_translation &&
+	  tr != ts->default_midi_translation[0] &&
+	  tr != ts->default_midi_translation[1])
+	warning("[%s] is never used, it is replaced by a later default section\n", tr->name);
+      continue;
+    }
+    for (j = 0; j < i; j++) {
+      translation *tr2 = ts->sections[j];
+      if (!tr2->is_default && !strcmp(tr->pattern, tr2->pattern) &&
+	  (tr2->mode == 0 || tr2->mode == tr->mode)) {
+	warning("[%s] is never used, it is shadowed by [%s] with the same regex\n", tr->name, tr2->name);
+	break;
+      }
+    }
+  }
+}
+
+// Rules for a shift state can't ever be triggered if there's no key for
+// that shift state anywhere.
+static void
+check_shifts(translation_set *ts)
+{
+  int used[N_ST] = { 0 }, n_rules[N_ST] = { 0 };
+  int t, k, kind, index;
+  uint16_t i, n;
+
+  for (t = 0; t < ts->n_sections; t++) {
+    translation *tr = ts->sections[t];
+    for (k = 0; k < N_ST; k++) {
+      for (kind = 0; kind < N_KINDS; kind++) {
+	stroke_data *sd = get_stroke_data(tr, kind, k, &n);
+	for (i = 0; i < n; i++) {
+	  for (index = 0; index < 2; index++) {
+	    stroke *s;
+	    for (s = sd[i].s[index]; s; s = s->next)
+	      if (s->shift > 0 && s->shift < N_ST) used[s->shift] = 1;
+	  }
+	  if (k > 0) n_rules[k]++;
+	}
+      }
+    }
+  }
+  for (k = 1; k < N_ST; k++) {
+    if (n_rules[k] && !used[k])
+      warning("%d rule%s for SHIFT%d can never be used, there's no SHIFT%d key\n",
+	      n_rules[k], n_rules[k]>1?"s":"", k, k);
+  }
+}
+
+int
+check_config(void)
+{
+  config_timing t;
+  translation_set *ts;
+  size_t total_mem;
+  long total = 0;
+  int i, k, kind, layers[N_ST] = { 0 };
+
+  memset(&t, 0, sizeof(t));
+  ts = load_config_for_check(&t);
+  if (!ts) return 1;
+  check_sections(ts);
+  for (i = 0; i < ts->n_sections; i++)
+    check_macros(ts, ts->sections[i]);
+  check_shifts(ts);
+  fflush(stderr);
+  printf("%s: %d section%s\n", config_file_name, ts->n_sections,
+	 ts->n_sections==1?"":"s");
+  // entries per section and shift state, and memory per section
+  // only list the shift states which have rules of their own
+  for (i = 0; i < ts->n_sections; i++)
+    for (k = 0; k < N_ST; k++)
+      for (kind = 0; kind < N_KINDS; kind++) {
+	uint16_t n;
+	(void)get_stroke_data(ts->sections[i], kind, k, &n);
+	if (n) layers[k] = 1;
+      }
+  layers[0] = 1;
+  printf("%-24s", "section");
+  for (k = 0; k < N_ST; k++) {
+    char label[10] = "unshift";
+    if (!layers[k]) continue;
+    if (k) sprintf(label, "SHIFT%d", k);
+    printf(" %7s", label);
+  }
+  printf(" %10s\n", "bytes");
+  total_mem = ts->mem.size;
+  for (i = 0; i < ts->n_sections; i++) {
+    translation *tr = ts->sections[i];
+    char name[26];
+    snprintf(name, sizeof(name), "[%s]", tr->name);
+    printf("%-24s", name);
+    for (k = 0; k < N_ST; k++) {
+      long count = 0;
+      for (kind = 0; kind < N_KINDS; kind++) {
+	uint16_t n;
+	(void)get_stroke_data(tr, kind, k, &n);
+	count += n;
+      }
+      total += count;
+      if (layers[k]) printf(" %7ld", count);
+    }
+    printf(" %10zu\n", tr->mem.size);
+    total_mem += tr->mem.size;
+  }
+  printf("%ld entries (", total);
+  for (kind = 0; kind < N_KINDS; kind++) {
+    long count = 0;
+    for (i = 0; i < ts->n_sections; i++)
+      for (k = 0; k < N_ST; k++) {
+	uint16_t n;
+	(void)get_stroke_data(ts->sections[i], kind, k, &n);
+	count += n;
+      }
+    printf("%s%s %ld", kind?", ":"", kind_names[kind], count);
+  }
+  printf("), %zu bytes\n", total_mem);
+  printf("time: read %.3f ms, include %.3f ms, hash %.3f ms, parse %.3f ms (regex %.3f ms, finish %.3f ms)",
+	 t.read, t.include, t.hash, t.parse, t.regex, t.finish);
+  if (t.cached)
+    printf(", cache %.3f ms\n", t.cache);
+  else
+    printf(", no cache\n");
+  printf("%d error%s, %d warning%s\n", ts->errors, ts->errors==1?"":"s",
+	 warnings, warnings==1?"":"s");
+  return ts->errors > 0;
+}
@@ -0,0 +1,210 @@
+
+/*
+
+  The control socket (midizap --control).
+
+  This is a Unix domain socket which lets other programs query a running
+  midizap instance. A client connects, sends a command terminated with a
+  newline, and receives the reply, after which the connection is closed.
+  The following commands are understood:
+
+  stats: counters, current window, section and shift state, and latency
+  percentiles (see print_stats() in midizap.c)
+
+  values: the cached controller values (see print_values() in midizap.c)
+
+  rules: how often each rule was used, the rules which haven't been used
+  yet, and the messages without a translation (see print_rule_stats() in
+  midizap.c)
+
+  Each reply ends with a line 'end', so that clients can tell a complete
+  reply from one that was cut short.
+
+  The socket is served by the main loop in between batches of MIDI input,
+  so that the state can be inspected without any locking. Client sockets are
+  non-blocking, so that a slow client can't hold up the main loop; if a
+  reply doesn't fit into the socket buffer, the rest is kept and sent
+  whenever the client is ready to take more.
+
+*/
+
+#include "midizap.h"
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define MAX_CMD 256
+
+static int listen_fd = -1;
+static char *socket_name;
+static struct {
+  int fd, len;
+  char cmd[MAX_CMD];
+  // the reply, and how much of it has been sent
+  char *out;
+  size_t out_len, out_pos;
+} clients[MAX_CONTROL_CLIENTS];
+static int n_clients = 0;
+
+int
+init_control(char *name)
+{
+  struct sockaddr_un addr;
+
+  if (strlen(name) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "%s: socket name too long\n", name);
+    return 0;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, name);
+  listen_fd = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+  if (listen_fd < 0) {
+    perror("socket");
+    return 0;
+  }
+  // get rid of a stale socket from a previous run
+  unlink(name);
+  if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+      listen(listen_fd, MAX_CONTROL_CLIENTS) < 0) {
+    perror(name);
+    close(listen_fd);
+    listen_fd = -1;
+    return 0;
+  }
+  socket_name = name;
+  return 1;
+}
+
+// Add the file descriptors we need to watch to the poll set. Returns the
+// number of entries (at most MAX_CONTROL_CLIENTS+1).
+int
+control_pollfds(struct pollfd *pfd)
+{
+  int i, n = 0;
+  if (listen_fd < 0) return 0;
+  pfd[n].fd = listen_fd;
+  pfd[n++].events = POLLIN;
+  for (i = 0; i < n_clients; i++) {
+    pfd[n].fd = clients[i].fd;
+    pfd[n++].events = clients[i].out ? POLLOUT : POLLIN;
+  }
+  return n;
+}
+
+static void
+drop_client(int i)
+{
+  close(clients[i].fd);
+  free(clients[i].out);
+  clients[i] = clients[--n_clients];
+}
+
+// Send as much of the reply as the socket takes. Returns 1 if there's more
+// to send, 0 if we're done with the client (or it went away).
+static int
+send_reply(int i)
+{
+  while (clients[i].out_pos < clients[i].out_len) {
+    // If the client went away, there's nothing we can do about it, but we
+    // don't want to get killed by SIGPIPE either.
+    ssize_t k = send(clients[i].fd, clients[i].out + clients[i].out_pos,
+		     clients[i].out_len - clients[i].out_pos, MSG_NOSIGNAL);
+    if (k < 0 && errno == EINTR) continue;
+    if (k < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 1;
+    if (k <= 0) return 0;
+    clients[i].out_pos += k;
+  }
+  return 0;
+}
+
+// Compose the reply to the client's command. Returns 0 if there's nothing
+// to send.
+static int
+reply(int i)
+{
+  char *cmd = clients[i].cmd, *buf = NULL;
+  size_t len = 0;
+  FILE *fp = open_memstream(&buf, &len);
+  if (!fp) return 0;
+  cmd[strcspn(cmd, " \t\r\n")] = 0;
+  if (!strcmp(cmd, "stats"))
+    print_stats(fp);
+  else if (!strcmp(cmd, "values"))
+    print_values(fp);
+  else if (!strcmp(cmd, "rules"))
+    print_rule_stats(fp);
+  else
+    fprintf(fp, "error: unknown command '%s', must be stats, values or rules\n",
+	    cmd);
+  fprintf(fp, "end\n");
+  if (fclose(fp)) {
+    free(buf);
+    return 0;
+  }
+  clients[i].out = buf;
+  clients[i].out_len = len;
+  clients[i].out_pos = 0;
+  return 1;
+}
+
+// Process the poll results for the entries added by control_pollfds().
+void
+process_control(struct pollfd *pfd, int n)
+{
+  int i, j;
+  if (n <= 0) return;
+  // Serve the clients first, since accepting new connections changes the
+  // client table. We go backwards, so that dropping a client doesn't
+  // affect the remaining entries.
+  for (j = n-1; j > 0; j--) {
+    ssize_t k;
+    char *nl;
+    i = j-1;
+    if (clients[i].out) {
+      // still sending the reply
+      if ((pfd[j].revents & (POLLOUT|POLLHUP|POLLERR)) && !send_reply(i))
+	drop_client(i);
+      continue;
+    }
+    if (!(pfd[j].revents & (POLLIN|POLLHUP|POLLERR))) continue;
+    k = read(clients[i].fd, clients[i].cmd + clients[i].len,
+	     MAX_CMD-1 - clients[i].len);
+    if (k <= 0) {
+      drop_client(i);
+      continue;
+    }
+    clients[i].len += k;
+    clients[i].cmd[clients[i].len] = 0;
+    nl = strchr(clients[i].cmd, '\n');
+    if (nl || clients[i].len == MAX_CMD-1) {
+      // most replies fit into the socket buffer right away
+      if (!reply(i) || !send_reply(i))
+	drop_client(i);
+    }
+  }
+  if (pfd[0].revents & POLLIN) {
+    int fd;
+    while ((fd = accept(listen_fd, NULL, NULL)) >= 0) {
+      if (n_clients == MAX_CONTROL_CLIENTS ||
+	  fcntl(fd, F_SETFL, O_NONBLOCK) < 0) {
+	close(fd);
+	continue;
+      }
+      fcntl(fd, F_SETFD, FD_CLOEXEC);
+      clients[n_clients].fd = fd;
+      clients[n_clients].out = NULL;
+      clients[n_clients++].len = 0;
+    }
+  }
+}
+
+void
+close_control(void)
+{
+  if (listen_fd < 0) return;
+  while (n_clients > 0) drop_client(0);
+  close(listen_fd);
+  listen_fd = -1;
+  unlink(socket_name);
+}
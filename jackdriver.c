@@ -32,6 +32,7 @@
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 #include <assert.h>
 #include <string.h>
@@ -46,9 +47,11 @@
 
 typedef struct _MidiMessage
 {
-    jack_nframes_t	time;
+    jack_nframes_t	time;	/* Time of the message (frames). */
     int		len;	/* Length of MIDI message, in bytes. */
     uint8_t	data[3];
+    uint64_t	stamp;	/* Arrival time of the input message (usecs). */
+    int		tag;	/* Translation which produced the message. */
 } MidiMessage;
 
 #define RINGBUFFER_SIZE		16384*sizeof(MidiMessage)
@@ -109,6 +112,16 @@ get_delta_time(void)
 }
 
 
+static uint64_t
+get_usecs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ((uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000);
+}
+
 double
 nframes_to_ms(jack_client_t* jack_client,jack_nframes_t nframes)
 {
@@ -121,7 +134,7 @@ nframes_to_ms(jack_client_t* jack_client,jack_nframes_t nframes)
     return ((nframes * 1000.0) / (double)sr);
 }
 
-void
+int
 queue_message(jack_ringbuffer_t* ringbuffer, MidiMessage *ev)
 {
     int written;
@@ -129,18 +142,24 @@ queue_message(jack_ringbuffer_t* ringbuffer, MidiMessage *ev)
     if (jack_ringbuffer_write_space(ringbuffer) < sizeof(*ev))
     {
         fprintf(stderr, "Not enough space in the ringbuffer, MIDI LOST.\n");
-        return;
+        return 0;
     }
 
     written = jack_ringbuffer_write(ringbuffer, (char *)ev, sizeof(*ev));
 
     if (written != sizeof(*ev))
+    {
         fprintf(stderr, "jack_ringbuffer_write failed, MIDI LOST.\n");
+        return 0;
+    }
+    return 1;
 }
 
 void
 process_midi_input(JACK_SEQ* seq,jack_nframes_t nframes)
 {
+  jack_nframes_t last_frame_time = jack_last_frame_time(seq->jack_client);
+  uint64_t now = get_usecs();
   int k;
 
   for (k = 0; k < seq->n_in; k++) {
@@ -186,6 +205,9 @@ process_midi_input(JACK_SEQ* seq,jack_nframes_t nframes)
       {
 	//successful event get
 
+	if (seq->capture && event.size >= 1)
+	  seq->capture(k, last_frame_time + event.time, event.buffer, event.size);
+
 	if (event.size <= 3 && event.size >= 1 && event.buffer[0] < 0xf0)
 	{
 	  //not sysex or something
@@ -193,9 +215,12 @@ process_midi_input(JACK_SEQ* seq,jack_nframes_t nframes)
 	  //PUSH ONTO CIRCULAR BUFFER
 	  //not sure if its a true copy onto buffer, if not this won't work
 	  rev.len = event.size;
-	  rev.time = event.time;
+	  rev.time = last_frame_time + event.time;
+	  rev.stamp = now;
+	  rev.tag = -1;
 	  memcpy(rev.data, event.buffer, rev.len);
-	  queue_message(seq->ringbuffer_in[k],&rev);
+	  if (!queue_message(seq->ringbuffer_in[k],&rev))
+	    seq->lost_in++;
 	}
 	else if (out_buffer && event.size >= 1 && event.buffer[0] >= 0xf0)
 	{
@@ -217,6 +242,7 @@ void
 process_midi_output(JACK_SEQ* seq,jack_nframes_t nframes)
 {
   jack_nframes_t last_frame_time = jack_last_frame_time(seq->jack_client);
+  uint64_t now = 0;
   int k;
 
   for (k = 0; k < seq->n_out; k++) {
@@ -279,6 +305,12 @@ process_midi_output(JACK_SEQ* seq,jack_nframes_t nframes)
       }
 
       memcpy(buffer, ev.data, ev.len);
+
+      if (seq->latency && ev.stamp)
+      {
+	if (!now) now = get_usecs();
+	seq->latency(ev.tag, now - ev.stamp);
+      }
     }
   }
 }
@@ -308,7 +340,8 @@ process_callback(jack_nframes_t nframes, void *seqq)
 ///////////////////////////////////////////////
 //these functions are executed in other threads
 ///////////////////////////////////////////////
-void queue_midi(void* seqq, uint8_t msg[], uint8_t port_no)
+void queue_midi(void* seqq, uint8_t msg[], uint8_t port_no,
+		uint64_t stamp, int tag)
 {
     MidiMessage ev;
     JACK_SEQ* seq = (JACK_SEQ*)seqq;
@@ -362,10 +395,14 @@ void queue_midi(void* seqq, uint8_t msg[], uint8_t port_no)
     ev.data[2] = msg[2];
 
     ev.time = jack_frame_time(seq->jack_client);
-    queue_message(seq->ringbuffer_out[port_no],&ev);
+    ev.stamp = stamp;
+    ev.tag = tag;
+    if (!queue_message(seq->ringbuffer_out[port_no],&ev))
+        seq->lost_out++;
 }
 
-int pop_midi(void* seqq, uint8_t msg[], uint8_t *port_no)
+int pop_midi(void* seqq, uint8_t msg[], uint8_t *port_no, uint64_t *stamp,
+	     jack_nframes_t *frames)
 {
   int read, k;
   MidiMessage ev;
@@ -388,6 +425,8 @@ int pop_midi(void* seqq, uint8_t msg[], uint8_t *port_no)
 
       memcpy(msg,ev.data,ev.len);
       *port_no = k;
+      *stamp = ev.stamp;
+      *frames = ev.time;
 
       return ev.len;
     }
@@ -17,6 +17,15 @@ typedef struct _jseq
   uint8_t n_in, n_out, passthrough[2];
   char *in[2], *out[2];
   regex_t inre[2], outre[2];
+  // latency measurements, see queue_midi() below
+  void (*latency)(int tag, uint64_t usecs);
+  // If set, this gets invoked with each message received on an input port,
+  // including system messages, along with its time in Jack frames. This is
+  // called in the Jack thread, so it must not block.
+  void (*capture)(uint8_t port_no, uint32_t frames, uint8_t *msg, size_t len);
+  // number of messages lost because a ringbuffer was full; lost_in is only
+  // written by the Jack thread, lost_out by the thread calling queue_midi()
+  unsigned long lost_in, lost_out;
 } JACK_SEQ;
 
 extern int jack_quit;
@@ -26,7 +35,16 @@ extern char *jack_command_line;
 int init_jack(JACK_SEQ* seq, uint8_t verbose);
 void process_connections(JACK_SEQ* seq);
 void close_jack(JACK_SEQ* seq);
-void queue_midi(void* seqq, uint8_t msg[], uint8_t port_no);
-int pop_midi(void* seqq, uint8_t msg[], uint8_t *port_no);
+// Input messages are time-stamped (CLOCK_MONOTONIC, in usecs) as they
+// arrive in the process callback. Output messages carry the time stamp of
+// the input message they were generated from, along with a tag identifying
+// the translation. Once an output message has been passed on to Jack,
+// seq->latency (if set) gets invoked with the tag and the elapsed time.
+// This is called in the Jack thread, so it must not block.
+void queue_midi(void* seqq, uint8_t msg[], uint8_t port_no,
+		uint64_t stamp, int tag);
+// pop_midi() also returns the arrival time of the message in Jack frames.
+int pop_midi(void* seqq, uint8_t msg[], uint8_t *port_no, uint64_t *stamp,
+	     jack_nframes_t *frames);
 
 #endif
@@ -0,0 +1,363 @@
+
+/*
+
+  midizap-load: synthetic MIDI load generator for midizap.
+
+  This is a little Jack client which sends MIDI messages to midizap's
+  midi_in port at a given rate and listens on midi_out, so that you can
+  find out how much input midizap can take, and check whether an
+  optimization actually makes a difference, without any MIDI hardware.
+  Each message carries a sequence number in its data bytes, which lets us
+  detect lost, reordered and duplicated messages, and measure the latency
+  of each message in Jack frames. For this to work, midizap needs to pass
+  the messages through unchanged, e.g.: midizap -t -s /dev/null
+
+  Note that system messages (the sysex pattern) are passed through by
+  midizap's Jack thread right away, while all other messages go through
+  the main loop, so they're reported as reordered when the two are mixed.
+
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <getopt.h>
+
+#include <jack/jack.h>
+#include <jack/midiport.h>
+
+#define MAX_PATTERNS 16
+#define MAX_SYSEX 1024
+
+enum { NOTE, CC, PB, SYSEX };
+static const char *pattern_names[] = { "note", "cc", "pb", "sysex" };
+
+static jack_client_t *client;
+static jack_port_t *in_port, *out_port;
+static jack_nframes_t sample_rate;
+
+// parameters
+static long count = 10000;
+static double rate = 1000.0;
+static int patterns[MAX_PATTERNS] = { NOTE, CC, PB }, n_patterns = 3;
+static int sysex_len = 16;
+
+// The sequence numbers are taken modulo these.
+#define CHAN_MOD (1L<<18) // channel, data bytes
+#define SYSEX_MOD (1L<<28) // 4 data bytes
+
+// Per-message results, filled in by the Jack thread and evaluated by the
+// main thread once we're done.
+static uint32_t *send_frames, *recv_frames;
+static uint8_t *received;
+static volatile int running = 0, done = 0;
+static volatile long n_sent = 0;
+static long hi_seq = -1, n_reordered = 0, n_dup = 0, n_unexpected = 0,
+  n_overruns = 0;
+static jack_nframes_t start_frame;
+
+static int
+make_message(long seq, uint8_t *buf)
+{
+  long id;
+  int i;
+  switch (patterns[seq % n_patterns]) {
+  case SYSEX:
+    // non-commercial manufacturer id, padded to the requested length
+    id = seq % SYSEX_MOD;
+    buf[0] = 0xf0; buf[1] = 0x7d;
+    for (i = 0; i < 4; i++) buf[2+i] = (id >> (7*i)) & 0x7f;
+    memset(buf+6, 0, sysex_len-7);
+    buf[sysex_len-1] = 0xf7;
+    return sysex_len;
+  default:
+    id = seq % CHAN_MOD;
+    buf[0] = (patterns[seq % n_patterns] == NOTE ? 0x90 :
+	      patterns[seq % n_patterns] == CC ? 0xb0 : 0xe0) | (id >> 14);
+    buf[1] = (id >> 7) & 0x7f;
+    buf[2] = id & 0x7f;
+    return 3;
+  }
+}
+
+// Reconstruct the sequence number of a received message. The id only has
+// the low order bits, so we pick the nearest sequence number to the
+// largest one received so far.
+static long
+get_seq(long id, long mod)
+{
+  long base = hi_seq < 0 ? 0 : hi_seq;
+  long seq = base - base % mod + id;
+  if (seq > base + mod/2)
+    seq -= mod;
+  else if (seq < base - mod/2)
+    seq += mod;
+  return seq;
+}
+
+static void
+receive(uint8_t *buf, size_t len, jack_nframes_t frames)
+{
+  long seq;
+  int kind;
+  if (len >= 7 && buf[0] == 0xf0 && buf[1] == 0x7d) {
+    kind = SYSEX;
+    seq = get_seq(buf[2] | (buf[3]<<7) | (buf[4]<<14) | ((long)buf[5]<<21),
+		  SYSEX_MOD);
+  } else if (len == 3 && (buf[0] & 0xf0) != 0xf0) {
+    switch (buf[0] & 0xf0) {
+    case 0x90: kind = NOTE; break;
+    case 0xb0: kind = CC; break;
+    case 0xe0: kind = PB; break;
+    default: n_unexpected++; return;
+    }
+    seq = get_seq(((buf[0] & 0x0f) << 14) | (buf[1] << 7) | buf[2], CHAN_MOD);
+  } else {
+    n_unexpected++;
+    return;
+  }
+  if (seq < 0 || seq >= n_sent || patterns[seq % n_patterns] != kind) {
+    n_unexpected++;
+    return;
+  }
+  if (received[seq]) {
+    n_dup++;
+    return;
+  }
+  received[seq] = 1;
+  recv_frames[seq] = frames;
+  if (seq < hi_seq)
+    n_reordered++;
+  else
+    hi_seq = seq;
+}
+
+static int
+process(jack_nframes_t nframes, void *arg)
+{
+  jack_nframes_t t0 = jack_last_frame_time(client);
+  void *in = jack_port_get_buffer(in_port, nframes);
+  void *out = jack_port_get_buffer(out_port, nframes);
+  jack_midi_event_t ev;
+  uint32_t i, n;
+
+  (void)arg;
+#ifdef JACK_MIDI_NEEDS_NFRAMES
+  jack_midi_clear_buffer(out, nframes);
+  n = jack_midi_get_event_count(in, nframes);
+#else
+  jack_midi_clear_buffer(out);
+  n = jack_midi_get_event_count(in);
+#endif
+  for (i = 0; i < n; i++) {
+#ifdef JACK_MIDI_NEEDS_NFRAMES
+    if (!jack_midi_event_get(&ev, in, i, nframes))
+#else
+    if (!jack_midi_event_get(&ev, in, i))
+#endif
+      receive(ev.buffer, ev.size, t0 + ev.time);
+  }
+  if (!running || done) return 0;
+  if (!n_sent) start_frame = t0;
+  while (n_sent < count) {
+    // time at which the next message is due, relative to this cycle
+    double due = (double)n_sent*sample_rate/rate -
+      (double)(uint32_t)(t0 - start_frame);
+    uint8_t buf[MAX_SYSEX], *p;
+    int len;
+    jack_nframes_t t;
+    if (due >= nframes) break;
+    // late messages (the buffer was full in the previous cycle) go first
+    t = due > 0 ? (jack_nframes_t)due : 0;
+    len = make_message(n_sent, buf);
+#ifdef JACK_MIDI_NEEDS_NFRAMES
+    p = jack_midi_event_reserve(out, t, len, nframes);
+#else
+    p = jack_midi_event_reserve(out, t, len);
+#endif
+    if (!p) {
+      n_overruns++;
+      break;
+    }
+    memcpy(p, buf, len);
+    send_frames[n_sent] = t0 + t;
+    n_sent++;
+  }
+  return 0;
+}
+
+static void
+quitter(int sig)
+{
+  (void)sig;
+  done = 1;
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+  double x = *(const double*)a, y = *(const double*)b;
+  return x < y ? -1 : x > y;
+}
+
+static void
+report(void)
+{
+  double *lat = malloc((n_sent+1)*sizeof(double)), sum = 0, msecs;
+  long i, n = 0;
+  uint32_t last = start_frame;
+
+  for (i = 0; i < n_sent; i++) {
+    if (!received[i]) continue;
+    lat[n] = (int32_t)(recv_frames[i] - send_frames[i]) * 1000.0 / sample_rate;
+    sum += lat[n++];
+    if ((int32_t)(recv_frames[i] - last) > 0) last = recv_frames[i];
+  }
+  msecs = (uint32_t)(last - start_frame) * 1000.0 / sample_rate;
+  printf("sent %ld messages at %g/s, received %ld in %.1f ms (%.0f/s)\n",
+	 n_sent, rate, n, msecs, msecs > 0 ? n*1000.0/msecs : 0);
+  printf("lost %ld (%.2f%%), reordered %ld, duplicates %ld, unexpected %ld, output overruns %ld\n",
+	 n_sent-n, n_sent ? 100.0*(n_sent-n)/n_sent : 0, n_reordered, n_dup,
+	 n_unexpected, n_overruns);
+  if (n) {
+    double limit = 0.5;
+    long k = 0;
+    qsort(lat, n, sizeof(double), cmp_double);
+    printf("latency (ms): min %.3f, avg %.3f, 50%% %.3f, 90%% %.3f, 99%% %.3f, 99.9%% %.3f, max %.3f\n",
+	   lat[0], sum/n, lat[n/2], lat[n*9/10], lat[n*99/100],
+	   lat[n*999/1000], lat[n-1]);
+    // histogram, in powers of 2
+    for (; k < n; limit *= 2) {
+      long c = 0;
+      while (k < n && lat[k] < limit) k++, c++;
+      if (c)
+	printf("  < %8g ms: %8ld %6.2f%%\n", limit, c, 100.0*c/n);
+    }
+  }
+  free(lat);
+}
+
+static void
+usage(char *progname)
+{
+  fprintf(stderr, "Usage: %s [-h] [-j name] [-t target] [-n count] [-r rate] [-p patterns] [-l len] [-w msecs]\n", progname);
+  fprintf(stderr, "-h print this message\n");
+  fprintf(stderr, "-j jack client name (default: midizap-load)\n");
+  fprintf(stderr, "-t jack client to test (default: midizap)\n");
+  fprintf(stderr, "-n number of messages to send (default: 10000)\n");
+  fprintf(stderr, "-r messages per second (default: 1000)\n");
+  fprintf(stderr, "-p comma-separated list of note, cc, pb, sysex (default: note,cc,pb)\n");
+  fprintf(stderr, "-l length of sysex messages (default: 16)\n");
+  fprintf(stderr, "-w time to wait for late messages, in msecs (default: 1000)\n");
+}
+
+int
+main(int argc, char **argv)
+{
+  char *client_name = "midizap-load", *target = "midizap";
+  char port[1024];
+  int opt, wait = 1000;
+
+  while ((opt = getopt(argc, argv, "hj:t:n:r:p:l:w:")) != -1) {
+    switch (opt) {
+    case 'h':
+      usage(argv[0]);
+      exit(0);
+    case 'j':
+      client_name = optarg;
+      break;
+    case 't':
+      target = optarg;
+      break;
+    case 'n':
+      count = atol(optarg);
+      break;
+    case 'r':
+      rate = atof(optarg);
+      break;
+    case 'l':
+      sysex_len = atoi(optarg);
+      break;
+    case 'w':
+      wait = atoi(optarg);
+      break;
+    case 'p': {
+      char *s = strtok(optarg, ",");
+      n_patterns = 0;
+      while (s) {
+	int k;
+	for (k = 0; k < 4 && strcmp(s, pattern_names[k]); k++) ;
+	if (k == 4 || n_patterns == MAX_PATTERNS) {
+	  fprintf(stderr, "%s: bad pattern (-p): %s\n", argv[0], s);
+	  exit(1);
+	}
+	patterns[n_patterns++] = k;
+	s = strtok(NULL, ",");
+      }
+      break;
+    }
+    default:
+      fprintf(stderr, "Try -h for help.\n");
+      exit(1);
+    }
+  }
+  if (count <= 0 || rate <= 0 || n_patterns == 0 ||
+      sysex_len < 7 || sysex_len > MAX_SYSEX) {
+    fprintf(stderr, "%s: bad parameters\n", argv[0]);
+    exit(1);
+  }
+
+  send_frames = calloc(count, sizeof(uint32_t));
+  recv_frames = calloc(count, sizeof(uint32_t));
+  received = calloc(count, 1);
+  if (!send_frames || !recv_frames || !received) {
+    fprintf(stderr, "Memory allocation failed\n");
+    exit(1);
+  }
+
+  client = jack_client_open(client_name, JackNullOption, NULL);
+  if (!client) {
+    fprintf(stderr, "Could not connect to the JACK server; run jackd first?\n");
+    exit(1);
+  }
+  sample_rate = jack_get_sample_rate(client);
+  in_port = jack_port_register(client, "midi_in", JACK_DEFAULT_MIDI_TYPE,
+			       JackPortIsInput, 0);
+  out_port = jack_port_register(client, "midi_out", JACK_DEFAULT_MIDI_TYPE,
+				JackPortIsOutput, 0);
+  if (!in_port || !out_port) {
+    fprintf(stderr, "Could not register JACK port.\n");
+    exit(1);
+  }
+  jack_set_process_callback(client, process, NULL);
+  if (jack_activate(client)) {
+    fprintf(stderr, "Could not activate JACK client.\n");
+    exit(1);
+  }
+  snprintf(port, sizeof(port), "%s:midi_in", target);
+  if (jack_connect(client, jack_port_name(out_port), port)) {
+    fprintf(stderr, "Could not connect to %s\n", port);
+    exit(1);
+  }
+  snprintf(port, sizeof(port), "%s:midi_out", target);
+  if (jack_connect(client, port, jack_port_name(in_port))) {
+    fprintf(stderr, "Could not connect to %s\n", port);
+    exit(1);
+  }
+
+  signal(SIGINT, quitter);
+  // give the connections some time to settle
+  usleep(100000);
+  running = 1;
+  while (!done && n_sent < count) usleep(10000);
+  // wait for stragglers
+  if (!done) usleep(wait*1000);
+  done = 1;
+  jack_deactivate(client);
+  report();
+  jack_client_close(client);
+  return 0;
+}
@@ -14,6 +14,9 @@
 
 #include "midizap.h"
 #include "jackdriver.h"
+#include "uinput.h"
+#include <semaphore.h>
+#include <getopt.h>
 
 typedef struct input_event EV;
 
@@ -24,6 +27,13 @@ int jack_num_outputs = 0, debug_jack = 0;
 int auto_feedback = 1;
 int passthrough[2] = {-1, -1}, system_passthrough[2] = {-1, -1};
 int shift = 0;
+// key and mouse output through uinput rather than XTest (-u)
+int use_uinput = 0;
+
+// Atoms for the window properties used in window matching. WM_NAME and
+// WM_CLASS are predefined, the others are interned when the display is
+// opened, so that we don't have to ask the server again and again.
+static Atom net_wm_name = None, utf8_string = None;
 
 void
 initdisplay(void)
@@ -32,33 +42,488 @@ initdisplay(void)
 
   display = XOpenDisplay(0);
   if (!display) {
+    if (use_uinput) {
+      // We can do without X in this case, but then we can't determine the
+      // focused window, so only the default translations will be used.
+      fprintf(stderr, "unable to open X display, only default translations will be used\n");
+      return;
+    }
     fprintf(stderr, "unable to open X display\n");
     exit(1);
   }
-  if (!XTestQueryExtension(display, &event, &error, &major, &minor)) {
+  if (!use_uinput &&
+      !XTestQueryExtension(display, &event, &error, &major, &minor)) {
     fprintf(stderr, "Xtest extensions not supported\n");
     XCloseDisplay(display);
     exit(1);
   }
+  // intern all atoms in one go, this needs only a single round trip
+  char *atom_names[] = { "_NET_WM_NAME", "UTF8_STRING" };
+  Atom atoms[2];
+  if (XInternAtoms(display, atom_names, 2, False, atoms)) {
+    net_wm_name = atoms[0];
+    utf8_string = atoms[1];
+  }
+}
+
+static uint64_t get_usecs(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+// Latency statistics (SIGUSR1, -dl). Each MIDI input event is time-stamped
+// when it arrives in the Jack process callback, and the stamp is passed
+// along with the resulting output, together with a tag which identifies the
+// translation (section and rule) which produced it. The time elapsed until
+// MIDI output is passed on to Jack, or key output is flushed, is recorded
+// in a histogram for each rule. The histograms are updated from the Jack and
+// output threads, so this is done with atomic operations only. The tags are
+// indices into a fixed-size table, which is only ever extended by the main
+// thread; tag 0 is used for untranslated messages (pass-through), and the
+// last entry collects all rules which don't fit into the table anymore.
+
+// The same table also keeps track of how often each rule is used, and how
+// often it was reached by falling back from the section of the focused
+// window to the [MIDI], [MIDI2] or [Default] section. Together with the
+// messages which weren't translated at all (see below), this is reported by
+// the 'rules' command of the control socket.
+
+// Latencies are recorded with 4 buckets per power of 2 (i.e., with a
+// resolution of 25%), up to about a minute.
+#define N_LATENCY_BUCKETS 100
+#define MAX_RULE_STATS 1024
+
+typedef struct {
+  translation *tr;
+  // the stroke sequence of the rule, so that we can tell which rules in the
+  // configuration have never been used
+  stroke *s;
+  // section and rule name (truncated) for printing, the section may be gone
+  // by then
+  char section[32], rule[104];
+  uint8_t used, status, chan, shift, index;
+  int8_t dir;
+  int data;
+  // number of times the rule was executed, and how many of these were
+  // fallbacks (main thread only)
+  uint32_t hits, fallbacks;
+  // number of latency measurements, maximum and histogram
+  uint32_t count, max, buckets[N_LATENCY_BUCKETS];
+} RuleStats;
+
+static RuleStats rule_stats[MAX_RULE_STATS];
+
+// Messages without a translation, which are either passed through (-t) or
+// dropped, for the 'rules' command of the control socket. This is a hash
+// table like the above, keyed by port and message (the data byte is zero for
+// channel pressure and pitch bends); the last entry collects the messages
+// which don't fit into the table anymore. Main thread only.
+#define MAX_MSG_STATS 1024
+
+typedef struct {
+  uint8_t used, portno, status, chan, data;
+  uint32_t missed, passed;
+} MsgStats;
+
+static MsgStats msg_stats[MAX_MSG_STATS];
+// print the statistics on exit (-dl)
+static int debug_latency = 0;
+// set by the SIGUSR1 handler
+static volatile sig_atomic_t dump_latency = 0;
+
+// time stamp and tag of the input event currently being processed
+static uint64_t event_stamp = 0;
+// time of the current input message in Jack frames (for --capture)
+static jack_nframes_t event_frames = 0;
+static int event_tag = -1;
+
+// Counters for the control socket (see control.c). These are only updated
+// and read by the main thread.
+static unsigned long events_in[2], events_out[2], keys_out, keys_dropped;
+static unsigned long focus_queries, focus_changes, trace_skipped;
+static time_t start_time;
+
+static int latency_bucket(uint32_t usecs)
+{
+  int e, i;
+  if (usecs < 8) return usecs;
+  e = 31 - __builtin_clz(usecs);
+  i = 8 + (e-3)*4 + ((usecs >> (e-2)) & 3);
+  return i < N_LATENCY_BUCKETS ? i : N_LATENCY_BUCKETS-1;
+}
+
+// upper bound of the latencies in the given bucket
+static uint32_t latency_limit(int i)
+{
+  int e = (i-8)/4 + 3;
+  if (i < 8) return i;
+  return ((5 + (i-8)%4) << (e-2)) - 1;
+}
+
+static void record_latency(int tag, uint64_t usecs)
+{
+  RuleStats *r;
+  uint32_t v = usecs > UINT32_MAX ? UINT32_MAX : usecs, max;
+  if (tag < 0 || tag >= MAX_RULE_STATS) return;
+  r = &rule_stats[tag];
+  __atomic_fetch_add(&r->count, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&r->buckets[latency_bucket(v)], 1, __ATOMIC_RELAXED);
+  max = __atomic_load_n(&r->max, __ATOMIC_RELAXED);
+  while (v > max &&
+	 !__atomic_compare_exchange_n(&r->max, &max, v, 1,
+				      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+// Key events which are waiting to be flushed, so that we can record their
+// latencies when they are. Successive keys of the same translation are only
+// recorded once.
+#define MAX_PENDING_KEYS 32
+
+typedef struct {
+  int n;
+  uint64_t stamp[MAX_PENDING_KEYS];
+  int tag[MAX_PENDING_KEYS];
+} PendingKeys;
+
+static void add_pending_key(PendingKeys *p, uint64_t stamp, int tag)
+{
+  if (!stamp || (p->n && p->stamp[p->n-1] == stamp && p->tag[p->n-1] == tag))
+    return;
+  if (p->n < MAX_PENDING_KEYS) {
+    p->stamp[p->n] = stamp;
+    p->tag[p->n++] = tag;
+  } else
+    // no more room, just record the time until now
+    record_latency(tag, get_usecs() - stamp);
+}
+
+static void flush_pending_keys(PendingKeys *p)
+{
+  if (p->n) {
+    uint64_t now = get_usecs();
+    for (int i = 0; i < p->n; i++)
+      record_latency(p->tag[i], now - p->stamp[i]);
+    p->n = 0;
+  }
+}
+
+// Keyboard and mouse output. So that a busy X server doesn't hold up the
+// translation of subsequent MIDI events (in particular, MIDI feedback), the
+// actual XTest (or uinput) calls are done in a separate output thread with
+// its own X connection, which is fed by the main thread through a lock-free
+// ringbuffer. If the output thread can't be started, we fall back to doing
+// the output synchronously in the main thread.
+
+enum { OUT_KEY, OUT_BUTTON, OUT_FLUSH, OUT_QUIT };
+
+typedef struct {
+  uint8_t type, press;
+  uint16_t code;
+  // time stamp and tag of the input event, for the latency statistics
+  int tag;
+  uint64_t stamp;
+} OutputEvent;
+
+// size of the output queue (number of events)
+#define OUTPUT_QUEUE_SIZE 4096
+
+static Display *out_display;
+static jack_ringbuffer_t *out_queue;
+static sem_t out_sem;
+static pthread_t out_thread;
+static int out_running = 0;
+// set by the main thread if it couldn't queue an OUT_FLUSH
+static int out_flush_missed = 0;
+// pending keys in synchronous mode
+static PendingKeys sync_keys;
+
+static void
+output_button(Display *dpy, unsigned int button, int press)
+{
+  PROF_BEGIN(prof_t);
+  if (use_uinput)
+    uinput_send_button(button, press);
+  else
+    XTestFakeButtonEvent(dpy, button, press ? True : False, DELAY);
+  PROF_END(PROF_OUTPUT, prof_t);
+}
+
+static void
+output_key(Display *dpy, int keycode, int press)
+{
+  PROF_BEGIN(prof_t);
+  if (use_uinput)
+    uinput_send_key(keycode, press);
+  else
+    XTestFakeKeyEvent(dpy, keycode, press ? True : False, DELAY);
+  PROF_END(PROF_OUTPUT, prof_t);
+}
+
+static void
+output_flush(Display *dpy)
+{
+  PROF_BEGIN(prof_t);
+  if (use_uinput)
+    uinput_flush();
+  else
+    XFlush(dpy);
+  PROF_END(PROF_FLUSH, prof_t);
+}
+
+static void *
+output_thread(void *arg)
+{
+  OutputEvent ev;
+  PendingKeys pending = { 0 };
+
+  (void)arg;
+  while (1) {
+    // we get woken up whenever the main thread flushes its output
+    sem_wait(&out_sem);
+    while (jack_ringbuffer_read(out_queue, (char*)&ev, sizeof(ev)) ==
+	   sizeof(ev)) {
+      switch (ev.type) {
+      case OUT_KEY:
+	output_key(out_display, ev.code, ev.press);
+	add_pending_key(&pending, ev.stamp, ev.tag);
+	break;
+      case OUT_BUTTON:
+	output_button(out_display, ev.code, ev.press);
+	add_pending_key(&pending, ev.stamp, ev.tag);
+	break;
+      case OUT_FLUSH:
+	output_flush(out_display);
+	flush_pending_keys(&pending);
+	break;
+      case OUT_QUIT:
+	output_flush(out_display);
+	return NULL;
+      }
+    }
+    // If the main thread found the queue full when it wanted to flush, do
+    // the flush now that we caught up, so that the keys don't sit in the
+    // output buffer until the next MIDI event comes along.
+    if (__atomic_exchange_n(&out_flush_missed, 0, __ATOMIC_ACQ_REL)) {
+      output_flush(out_display);
+      flush_pending_keys(&pending);
+    }
+  }
+}
+
+// Add an event to the output queue. Returns 1 if the event was queued, 0 if
+// the queue is full, in which case the output thread (or the X server) is
+// too far behind and waiting for it would just hold up the translation of
+// MIDI input. A flush which doesn't fit is done by the output thread once
+// it has caught up, see above. Only OUT_QUIT waits for the output thread.
+// This is only called from the main thread.
+static int
+queue_output(int type, int code, int press)
+{
+  OutputEvent ev = { type, press, code, event_tag, event_stamp };
+  while (jack_ringbuffer_write_space(out_queue) < sizeof(ev)) {
+    if (type == OUT_FLUSH)
+      __atomic_store_n(&out_flush_missed, 1, __ATOMIC_RELEASE);
+    sem_post(&out_sem);
+    if (type != OUT_QUIT) return 0;
+    usleep(100);
+  }
+  jack_ringbuffer_write(out_queue, (char*)&ev, sizeof(ev));
+  return 1;
+}
+
+// Key and button events which don't fit into the output queue can't just be
+// dropped, since a key whose release gets lost would be stuck. So we keep
+// track of the state of each key and button here (keys are indexed by key
+// code, buttons come after that). Presses are dropped (and counted, see
+// print_stats()) if the queue is full, as is the release of a key whose
+// press was dropped. The release of a key which is down is postponed until
+// there's room in the queue again, see queue_releases(). This is only used
+// by the main thread.
+
+enum { KEY_IS_UP, KEY_IS_DOWN, KEY_DROPPED, KEY_RELEASE_PENDING };
+
+#define N_OUT_KEYS (256+8)
+static uint8_t out_keys[N_OUT_KEYS];
+static int out_releases_pending = 0;
+
+// Queue the postponed releases. Returns the number of releases which were
+// queued, and leaves the rest for the next try.
+static int
+queue_releases(void)
+{
+  int k, n = 0;
+  for (k = 0; out_releases_pending && k < N_OUT_KEYS; k++) {
+    if (out_keys[k] != KEY_RELEASE_PENDING) continue;
+    if (!queue_output(k < 256 ? OUT_KEY : OUT_BUTTON, k < 256 ? k : k-256, 0))
+      break;
+    out_keys[k] = KEY_IS_UP;
+    out_releases_pending--;
+    n++;
+  }
+  return n;
+}
+
+static void
+queue_key(int type, int code, int press)
+{
+  int k = type == OUT_BUTTON ? 256+code : code;
+  if (k < 0 || k >= N_OUT_KEYS) return;
+  if (press) {
+    // postponed releases go first, so that the events stay in order
+    queue_releases();
+    if (out_releases_pending || !queue_output(type, code, 1)) {
+      if (out_keys[k] != KEY_RELEASE_PENDING) out_keys[k] = KEY_DROPPED;
+      keys_dropped++;
+      return;
+    }
+    out_keys[k] = KEY_IS_DOWN;
+  } else if (out_keys[k] == KEY_DROPPED) {
+    // the press never made it, so there's nothing to release
+    out_keys[k] = KEY_IS_UP;
+    keys_dropped++;
+  } else if (out_keys[k] != KEY_RELEASE_PENDING) {
+    queue_releases();
+    if (!out_releases_pending && queue_output(type, code, 0))
+      out_keys[k] = KEY_IS_UP;
+    else if (out_keys[k] == KEY_IS_DOWN) {
+      out_keys[k] = KEY_RELEASE_PENDING;
+      out_releases_pending++;
+    } else
+      // not pressed by us, so no harm done
+      keys_dropped++;
+  }
+}
+
+static void
+init_output(void)
+{
+  if (!use_uinput) {
+    // Xlib connections can't be shared between threads (unless we go
+    // through XInitThreads), so the output thread gets its own.
+    out_display = XOpenDisplay(0);
+    if (!out_display) {
+      fprintf(stderr, "unable to open X display for output thread, output will be synchronous\n");
+      return;
+    }
+  }
+  out_queue = jack_ringbuffer_create(OUTPUT_QUEUE_SIZE*sizeof(OutputEvent));
+  if (!out_queue) {
+    fprintf(stderr, "cannot create output queue, output will be synchronous\n");
+    goto errout;
+  }
+  jack_ringbuffer_mlock(out_queue);
+  if (sem_init(&out_sem, 0, 0)) {
+    perror("sem_init");
+    goto errout;
+  }
+  if (pthread_create(&out_thread, NULL, output_thread, NULL)) {
+    perror("pthread_create");
+    sem_destroy(&out_sem);
+    goto errout;
+  }
+  out_running = 1;
+  return;
+ errout:
+  if (out_queue) jack_ringbuffer_free(out_queue);
+  out_queue = NULL;
+  if (out_display) XCloseDisplay(out_display);
+  out_display = NULL;
+}
+
+static void
+close_output(void)
+{
+  if (!out_running) return;
+  // make sure that we don't leave any keys pressed
+  while (out_releases_pending) {
+    queue_releases();
+    usleep(100);
+  }
+  queue_output(OUT_QUIT, 0, 0);
+  sem_post(&out_sem);
+  pthread_join(out_thread, NULL);
+  out_running = 0;
+  sem_destroy(&out_sem);
+  jack_ringbuffer_free(out_queue);
+  out_queue = NULL;
+  if (out_display) XCloseDisplay(out_display);
+  out_display = NULL;
 }
 
 void
 send_button(unsigned int button, int press)
 {
-  XTestFakeButtonEvent(display, button, press ? True : False, DELAY);
+  if (out_running)
+    queue_key(OUT_BUTTON, button, press);
+  else {
+    output_button(display, button, press);
+    add_pending_key(&sync_keys, event_stamp, event_tag);
+  }
 }
 
-void
-send_key(KeySym key, int press)
+// Look up the key code of a keysym. This is done when the configuration is
+// loaded, so that we only need to issue the XTest (or uinput) event at
+// runtime. With uinput, these are evdev key codes.
+int
+lookup_keycode(KeySym key)
 {
-  KeyCode keycode;
+  if (key >= XK_Button_1 && key <= XK_Scroll_Down)
+    return 0;
+  if (use_uinput) {
+    int code = uinput_keycode(key);
+    // Not in our table, ask the X server if we have one. X key codes are
+    // offset by 8 from the evdev codes.
+    if (!code && display) {
+      code = XKeysymToKeycode(display, key);
+      if (code) code -= 8;
+    }
+    return code;
+  }
+  if (!display) return 0;
+  return XKeysymToKeycode(display, key);
+}
 
+void
+send_key(KeySym key, int keycode, int press)
+{
+  keys_out++;
+  if (replaying) {
+    replay_key(key, press);
+    return;
+  }
   if (key >= XK_Button_1 && key <= XK_Scroll_Down) {
     send_button((unsigned int)key - XK_Button_0, press);
     return;
   }
-  keycode = XKeysymToKeycode(display, key);
-  XTestFakeKeyEvent(display, keycode, press ? True : False, DELAY);
+  // keysym not available in the current keyboard mapping
+  if (!keycode) return;
+  if (out_running)
+    queue_key(OUT_KEY, keycode, press);
+  else {
+    output_key(display, keycode, press);
+    add_pending_key(&sync_keys, event_stamp, event_tag);
+  }
+}
+
+// Process pending X events. We don't select any events, but the server
+// sends a MappingNotify to all clients whenever the keyboard mapping
+// changes, in which case we need to refresh the cached key codes.
+static void
+process_xevents(void)
+{
+  XEvent ev;
+
+  while (XPending(display)) {
+    XNextEvent(display, &ev);
+    if (ev.type == MappingNotify) {
+      XRefreshKeyboardMapping(&ev.xmapping);
+      if (ev.xmapping.request != MappingPointer)
+	refresh_keycodes();
+    }
+  }
 }
 
 // cached controller and pitch bend values
@@ -99,6 +564,20 @@ static int datavals(int val, int step, int *steps, int n_steps)
 void
 handle_event(uint8_t *msg, uint8_t portno, int depth, int recursive);
 
+// In replay mode, MIDI output goes to the replay log instead of Jack.
+static void
+output_midi(uint8_t *msg, uint8_t portno, int tag)
+{
+  events_out[portno]++;
+  if (replaying)
+    replay_midi(msg, portno);
+  else {
+    PROF_BEGIN(prof_t);
+    queue_midi(&seq, msg, portno, event_stamp, tag);
+    PROF_END(PROF_QUEUE_MIDI, prof_t);
+  }
+}
+
 void
 send_midi(uint8_t portno, stroke *s, int index, int dir,
 	  int mod, int mod_step, int mod_n_steps, int *mod_steps,
@@ -319,7 +798,7 @@ send_midi(uint8_t portno, stroke *s, int index, int dir,
     s->change = change;
     s->d = d; s->v = v;
   } else
-    queue_midi(&seq, msg, portno);
+    output_midi(msg, portno, event_tag);
 }
 
 static int stroke_data_cmp(const void *a, const void *b)
@@ -332,11 +811,8 @@ static int stroke_data_cmp(const void *a, const void *b)
     return ad->chan - bd->chan;
 }
 
-static stroke *find_stroke_data(stroke_data *sd,
-				int chan, int data, int index,
-				int *step, int *n_steps, int **steps,
-				int *incr, int *mod,
-				uint16_t n)
+static stroke_data *find_entry(stroke_data *sd, int chan, int data,
+			      uint16_t n)
 {
   if (n < 16) {
     // Linear search is presumably faster for small arrays, and we also avoid
@@ -344,125 +820,165 @@ static stroke *find_stroke_data(stroke_data *sd,
     // even with glibc's bsearch(), though (TODO: measure).
     uint16_t i;
     for (i = 0; i < n; i++) {
-      if (sd[i].chan == chan && sd[i].data == data) {
-	if (step) *step = sd[i].step[index];
-	if (n_steps) *n_steps = sd[i].n_steps[index];
-	if (steps) *steps = sd[i].steps[index];
-	if (incr) *incr = sd[i].is_incr;
-	if (mod) *mod = sd[i].mod;
-	return sd[i].s[index];
-      } else if (sd[i].chan > chan ||
-		 (sd[i].chan == chan && sd[i].data > data)) {
+      if (sd[i].chan == chan && sd[i].data == data)
+	return &sd[i];
+      else if (sd[i].chan > chan ||
+	       (sd[i].chan == chan && sd[i].data > data))
 	return NULL;
-      }
     }
     return NULL;
   } else {
     // binary search from libc
-    stroke_data *ret, key;
+    stroke_data key;
     key.chan = chan; key.data = data;
-    ret = bsearch(&key, sd, n, sizeof(stroke_data), stroke_data_cmp);
-    if (ret) {
-      if (step) *step = ret->step[index];
-      if (n_steps) *n_steps = ret->n_steps[index];
-      if (steps) *steps = ret->steps[index];
-      if (incr) *incr = ret->is_incr;
-      if (mod) *mod = ret->mod;
-      return ret->s[index];
-    } else
-      return NULL;
+    return bsearch(&key, sd, n, sizeof(stroke_data), stroke_data_cmp);
   }
 }
 
+// The shift layers only hold the rules which were given explicitly for a
+// shift state. Rules without a shift prefix are only stored in the
+// unshifted layer, and we fall back to these if the shift layer doesn't
+// have a translation of its own. sdx is the array for the other kind of
+// translation of the same message (key vs. incremental, if any); a rule of
+// that kind in the shift layer overrides the default rule.
+static stroke_data *lookup_entry(stroke_data **sd, uint16_t *n,
+				 stroke_data **sdx, uint16_t *nx,
+				 int shift, int chan, int data, int index)
+{
+  stroke_data *ret = find_entry(sd[shift], chan, data, n[shift]), *def;
+  if (!shift || (ret && ret->s[index]) ||
+      (sdx && find_entry(sdx[shift], chan, data, nx[shift])))
+    return ret;
+  def = find_entry(sd[0], chan, data, n[0]);
+  // no release seq in mod translations
+  if (def && def->anyshift && !(def->mod && index))
+    return def;
+  else
+    return ret;
+}
+
+#ifdef PROFILE
+// Set while debug_key() is looking up a rule. Those lookups are only done
+// for printing, and debug_key() also runs in the trace thread, so they must
+// not be counted as PROF_LOOKUP (this is thread-local, so that the trace
+// thread never touches the counters).
+static __thread int prof_untimed = 0;
+#define PROF_UNTIMED(x) (prof_untimed++, (x), prof_untimed--)
+#else
+#define PROF_UNTIMED(x) (x)
+#endif
+
+static stroke *find_stroke_data(stroke_data **sd, uint16_t *n,
+				stroke_data **sdx, uint16_t *nx,
+				int shift, int chan, int data, int index,
+				int *step, int *n_steps, int **steps,
+				int *incr, int *mod)
+{
+  PROF_BEGIN(prof_t);
+  stroke_data *ret = lookup_entry(sd, n, sdx, nx, shift, chan, data, index);
+#ifdef PROFILE
+  if (!prof_untimed) PROF_END(PROF_LOOKUP, prof_t);
+#endif
+  if (ret) {
+    if (step) *step = ret->step[index];
+    if (n_steps) *n_steps = ret->n_steps[index];
+    if (steps) *steps = ret->steps[index];
+    if (incr) *incr = ret->is_incr;
+    if (mod) *mod = ret->mod;
+    return ret->s[index];
+  } else
+    return NULL;
+}
+
 static stroke *find_note(translation *tr, int shift,
 			 int chan, int data, int index, int *mod,
 			 int *step, int *n_steps, int **steps)
 {
-  return find_stroke_data(tr->note[shift], chan, data, index,
-			  step, n_steps, steps, 0, mod,
-			  tr->n_note[shift]);
+  return find_stroke_data(tr->note, tr->n_note, tr->notes, tr->n_notes,
+			  shift, chan, data, index,
+			  step, n_steps, steps, 0, mod);
 }
 
 static stroke *find_notes(translation *tr, int shift,
 			int chan, int data, int index, int *step)
 {
-  return find_stroke_data(tr->notes[shift], chan, data, index, step,
-			  0, 0, 0, 0,
-			  tr->n_notes[shift]);
+  return find_stroke_data(tr->notes, tr->n_notes, tr->note, tr->n_note,
+			  shift, chan, data, index, step,
+			  0, 0, 0, 0);
 }
 
 static stroke *find_pc(translation *tr, int shift,
 		       int chan, int data, int index)
 {
-  return find_stroke_data(tr->pc[shift], chan, data, index, 0, 0, 0, 0, 0,
-			  tr->n_pc[shift]);
+  return find_stroke_data(tr->pc, tr->n_pc, 0, 0,
+			  shift, chan, data, index, 0, 0, 0, 0, 0);
 }
 
 static stroke *find_cc(translation *tr, int shift,
 		       int chan, int data, int index, int *mod,
 		       int *step, int *n_steps, int **steps)
 {
-  return find_stroke_data(tr->cc[shift], chan, data, index,
-			  step, n_steps, steps, 0, mod,
-			  tr->n_cc[shift]);
+  return find_stroke_data(tr->cc, tr->n_cc, tr->ccs, tr->n_ccs,
+			  shift, chan, data, index,
+			  step, n_steps, steps, 0, mod);
 }
 
 static stroke *find_ccs(translation *tr, int shift,
 			int chan, int data, int index, int *step, int *incr)
 {
-  return find_stroke_data(tr->ccs[shift], chan, data, index, step, 0, 0,
-			  incr, 0,
-			  tr->n_ccs[shift]);
+  return find_stroke_data(tr->ccs, tr->n_ccs, tr->cc, tr->n_cc,
+			  shift, chan, data, index, step, 0, 0,
+			  incr, 0);
 }
 
 static stroke *find_kp(translation *tr, int shift,
 		       int chan, int data, int index, int *mod,
 		       int *step, int *n_steps, int **steps)
 {
-  return find_stroke_data(tr->kp[shift], chan, data, index,
-			  step, n_steps, steps, 0, mod,
-			  tr->n_kp[shift]);
+  return find_stroke_data(tr->kp, tr->n_kp, tr->kps, tr->n_kps,
+			  shift, chan, data, index,
+			  step, n_steps, steps, 0, mod);
 }
 
 static stroke *find_kps(translation *tr, int shift,
 			int chan, int data, int index, int *step)
 {
-  return find_stroke_data(tr->kps[shift], chan, data, index, step,
-			  0, 0, 0, 0,
-			  tr->n_kps[shift]);
+  return find_stroke_data(tr->kps, tr->n_kps, tr->kp, tr->n_kp,
+			  shift, chan, data, index, step,
+			  0, 0, 0, 0);
 }
 
 static stroke *find_cp(translation *tr, int shift,
 		       int chan, int index, int *mod,
 		       int *step, int *n_steps, int **steps)
 {
-  return find_stroke_data(tr->cp[shift], chan, 0, index,
-			  step, n_steps, steps, 0, mod,
-			  tr->n_cp[shift]);
+  return find_stroke_data(tr->cp, tr->n_cp, tr->cps, tr->n_cps,
+			  shift, chan, 0, index,
+			  step, n_steps, steps, 0, mod);
 }
 
 static stroke *find_cps(translation *tr, int shift,
 			int chan, int index, int *step)
 {
-  return find_stroke_data(tr->cps[shift], chan, 0, index, step,
-			  0, 0, 0, 0,
-			  tr->n_cps[shift]);
+  return find_stroke_data(tr->cps, tr->n_cps, tr->cp, tr->n_cp,
+			  shift, chan, 0, index, step,
+			  0, 0, 0, 0);
 }
 
 static stroke *find_pb(translation *tr, int shift,
 		       int chan, int index, int *mod,
 		       int *step, int *n_steps, int **steps)
 {
-  return find_stroke_data(tr->pb[shift], chan, 0, index,
-			  step, n_steps, steps, 0, mod,
-			  tr->n_pb[shift]);
+  return find_stroke_data(tr->pb, tr->n_pb, tr->pbs, tr->n_pbs,
+			  shift, chan, 0, index,
+			  step, n_steps, steps, 0, mod);
 }
 
 static stroke *find_pbs(translation *tr, int shift,
 			int chan, int index, int *step)
 {
-  return find_stroke_data(tr->pbs[shift], chan, 0, index, step, 0, 0, 0, 0,
-			  tr->n_pbs[shift]);
+  return find_stroke_data(tr->pbs, tr->n_pbs, tr->pb, tr->n_pb,
+			  shift, chan, 0, index, step, 0, 0, 0, 0);
 }
 
 stroke *
@@ -512,31 +1028,18 @@ static char last_window_class[MAX_WINNAME_SIZE];
 static Window last_focused_window = 0;
 static translation *last_window_translation = NULL, *last_translation = NULL;
 static int last_window = 0;
+// This flag indicates that the input focus has already been checked in the
+// current batch of input events, see main() below.
+static int focus_valid = 0;
 
 void reload_callback(void)
 {
   last_focused_window = 0;
+  focus_valid = 0;
   last_window_translation = last_translation = NULL;
   last_window = 0;
 }
 
-static void debug_section(translation *tr)
-{
-  // we do some caching of the last printed translation here, so that we don't
-  // print the same message twice
-  if (debug_regex && (!last_window || tr != last_translation)) {
-    last_translation = tr;
-    last_window = 1;
-    if (tr) {
-      printf("translation: %s for %s (class %s)\n",
-	     tr->name, last_window_name, last_window_class);
-    } else {
-      printf("no translation found for %s (class %s)\n",
-	     last_window_name, last_window_class);
-    }
-  }
-}
-
 static char *note_name(int n)
 {
   static char *note_names[] = { "C", "C#", "D", "Eb", "E", "F", "F#", "G", "G#", "A", "Bb", "B" };
@@ -554,22 +1057,23 @@ static int note_octave(int n)
     return n/12 + midi_octave;
 }
 
-static char *debug_key(translation *tr, char *name,
+// Print a MIDI message in the config file syntax, as seen in shift state k.
+static char *debug_key(translation *tr, int k, char *name,
 		       int status, int chan, int data, int dir)
 {
   char prefix[10] = "";
-  if (shift) sprintf(prefix, "%d^", shift);
+  if (k) sprintf(prefix, "%d^", k);
   char *suffix = "";
   strcpy(name, "??");
   switch (status) {
   case 0x90: {
-    int mod = 0, step, n_steps, *steps;
+    int mod = 0, step = 1, n_steps, *steps;
     if (tr) {
       if (dir) {
 	step = 1;
-	(void)find_notes(tr, shift, chan, data, dir>0, &step);
+	PROF_UNTIMED(find_notes(tr, k, chan, data, dir>0, &step));
       } else
-	(void)find_note(tr, shift, chan, data, 0, &mod, &step, &n_steps, &steps);
+	PROF_UNTIMED(find_note(tr, k, chan, data, 0, &mod, &step, &n_steps, &steps));
     }
     if (dir)
       suffix = (dir<0)?"-":"+";
@@ -602,9 +1106,9 @@ static char *debug_key(translation *tr, char *name,
     if (tr) {
       if (dir) {
 	step = 1;
-	(void)find_kps(tr, shift, chan, data, dir>0, &step);
+	PROF_UNTIMED(find_kps(tr, k, chan, data, dir>0, &step));
       } else
-	(void)find_kp(tr, shift, chan, data, 0, &mod, &step, &n_steps, &steps);
+	PROF_UNTIMED(find_kp(tr, k, chan, data, 0, &mod, &step, &n_steps, &steps));
     }
     if (dir)
       suffix = (dir<0)?"-":"+";
@@ -637,9 +1141,9 @@ static char *debug_key(translation *tr, char *name,
     if (tr) {
       if (dir) {
 	step = 1;
-	(void)find_ccs(tr, shift, chan, data, dir>0, &step, &is_incr);
+	PROF_UNTIMED(find_ccs(tr, k, chan, data, dir>0, &step, &is_incr));
       } else
-	(void)find_cc(tr, shift, chan, data, 0, &mod, &step, &n_steps, &steps);
+	PROF_UNTIMED(find_cc(tr, k, chan, data, 0, &mod, &step, &n_steps, &steps));
     }
     if (is_incr)
       suffix = (dir<0)?"<":">";
@@ -675,9 +1179,9 @@ static char *debug_key(translation *tr, char *name,
     if (tr) {
       if (dir) {
 	step = 1;
-	(void)find_cps(tr, shift, chan, dir>0, &step);
+	PROF_UNTIMED(find_cps(tr, k, chan, dir>0, &step));
       } else
-	(void)find_cp(tr, shift, chan, 0, &mod, &step, &n_steps, &steps);
+	PROF_UNTIMED(find_cp(tr, k, chan, 0, &mod, &step, &n_steps, &steps));
     }
     if (!dir)
       suffix = "";
@@ -702,7 +1206,7 @@ static char *debug_key(translation *tr, char *name,
   }
   case 0xe0: {
     int step = 1;
-    if (tr) (void)find_pbs(tr, shift, chan, dir>0, &step);
+    if (tr) PROF_UNTIMED(find_pbs(tr, k, chan, dir>0, &step));
     if (!dir)
       suffix = "";
     else
@@ -719,36 +1223,621 @@ static char *debug_key(translation *tr, char *name,
   return name;
 }
 
-static void debug_input(int portno,
-			int status, int chan, int data, int data2)
+// Debugging output (-dr, -dk, -dm). Formatting and printing these messages
+// takes a lot longer than translating the MIDI event itself, so the main
+// thread only puts a binary record of each event into the trace queue,
+// which gets formatted and printed by a separate trace thread. This works
+// like the output queue above, except that records are dropped (and the
+// number of dropped records is reported later) rather than holding up the
+// main thread if the queue is full. Records refer to the sections and
+// strokes of the current configuration, so we need to wait until the
+// trace thread has caught up before a configuration is freed, see
+// sync_trace() below. If the trace thread can't be started, the messages
+// are printed synchronously.
+
+enum { TRACE_INPUT, TRACE_SECTION, TRACE_KEYS, TRACE_DROPPED, TRACE_SYNC,
+       TRACE_QUIT };
+
+typedef struct {
+  uint8_t type, portno, status, chan, index;
+  int8_t dir;
+  uint8_t shift;
+  // length of the window name and class following a TRACE_SECTION record
+  uint16_t len;
+  int data, data2, mod, step, n_steps, *steps;
+  translation *tr;
+  stroke *s;
+  // time at which the record was made (CLOCK_MONOTONIC, in usecs)
+  uint64_t time;
+} TraceEvent;
+
+// size of the trace queue (number of events)
+#define TRACE_QUEUE_SIZE 4096
+
+static jack_ringbuffer_t *trace_queue;
+static sem_t trace_sem, trace_sync_sem;
+static pthread_t trace_thread;
+static int trace_running = 0, trace_pending = 0, trace_dropped = 0;
+
+static void
+print_trace(TraceEvent *ev, char *names)
 {
   char name[100];
-  if (status == 0xe0)
-    // translate LSB,MSB to a pitch bend value in the range -8192..8191
-    data2 = ((data2 << 7) | data) - 8192;
-  else if (status == 0xd0)
-    data2 = data;
-  if (status == 0xc0)
-    printf("[%d] %s\n", portno,
-	   debug_key(0, name, status, chan, data, 0));
-  else if (status != 0xf0) // system messages ignored for now
-    printf("[%d] %s value = %d\n", portno,
-	   debug_key(0, name, status, chan, data, 0), data2);
+  int data2 = ev->data2;
+  switch (ev->type) {
+  case TRACE_INPUT:
+    if (ev->status == 0xe0)
+      // translate LSB,MSB to a pitch bend value in the range -8192..8191
+      data2 = ((data2 << 7) | ev->data) - 8192;
+    else if (ev->status == 0xd0)
+      data2 = ev->data;
+    if (ev->status == 0xc0)
+      printf("[%d] %s\n", ev->portno,
+	     debug_key(0, ev->shift, name, ev->status, ev->chan, ev->data, 0));
+    else if (ev->status != 0xf0) // system messages ignored for now
+      printf("[%d] %s value = %d\n", ev->portno,
+	     debug_key(0, ev->shift, name, ev->status, ev->chan, ev->data, 0),
+	     data2);
+    break;
+  case TRACE_SECTION:
+    if (ev->tr) {
+      printf("translation: %s for %s (class %s)\n",
+	     ev->tr->name, names, names+strlen(names)+1);
+    } else {
+      printf("no translation found for %s (class %s)\n",
+	     names, names+strlen(names)+1);
+    }
+    break;
+  case TRACE_KEYS:
+    print_stroke_sequence(debug_key(ev->tr, ev->shift, name, ev->status,
+				    ev->chan, ev->data, ev->dir),
+			  (ev->dir||ev->mod)?"":ev->index?"U":"D", ev->s,
+			  ev->mod, ev->step, ev->n_steps, ev->steps, data2);
+    break;
+  case TRACE_DROPPED:
+    printf("[%d trace message%s dropped]\n", ev->data, ev->data>1?"s":"");
+    break;
+  }
+}
+
+static void *
+trace_thread_proc(void *arg)
+{
+  TraceEvent ev;
+  char names[2*MAX_WINNAME_SIZE];
+
+  (void)arg;
+  while (1) {
+    sem_wait(&trace_sem);
+    while (jack_ringbuffer_read(trace_queue, (char*)&ev, sizeof(ev)) ==
+	   sizeof(ev)) {
+      if (ev.len)
+	jack_ringbuffer_read(trace_queue, names, ev.len);
+      switch (ev.type) {
+      case TRACE_SYNC:
+	fflush(stdout);
+	sem_post(&trace_sync_sem);
+	break;
+      case TRACE_QUIT:
+	fflush(stdout);
+	return NULL;
+      default:
+	print_trace(&ev, names);
+	break;
+      }
+    }
+    // Make sure that the output gets flushed after each batch (may be
+    // buffered when midizap is running inside a QjackCtl session).
+    fflush(stdout);
+  }
+}
+
+// Add a record to the trace queue, followed by len bytes of extra data. The
+// record and its data are written in one go, so that the trace thread never
+// gets to see an incomplete record. If wait is set, we wait until there's
+// enough space in the queue, otherwise the record is dropped.
+static void
+queue_trace(TraceEvent *ev, char *data, int len, int wait)
+{
+  char buf[sizeof(TraceEvent)+2*MAX_WINNAME_SIZE];
+
+  ev->time = get_usecs();
+  if (!trace_running) {
+    print_trace(ev, data);
+    return;
+  }
+  if (trace_dropped &&
+      jack_ringbuffer_write_space(trace_queue) >= sizeof(TraceEvent)) {
+    // report the number of dropped records first
+    TraceEvent drop = { .type = TRACE_DROPPED, .data = trace_dropped };
+    jack_ringbuffer_write(trace_queue, (char*)&drop, sizeof(drop));
+    trace_dropped = 0;
+  }
+  while (jack_ringbuffer_write_space(trace_queue) < sizeof(*ev)+len) {
+    if (!wait) {
+      trace_dropped++;
+      trace_skipped++;
+      return;
+    }
+    sem_post(&trace_sem);
+    usleep(100);
+  }
+  ev->len = len;
+  memcpy(buf, ev, sizeof(*ev));
+  if (len) memcpy(buf+sizeof(*ev), data, len);
+  jack_ringbuffer_write(trace_queue, buf, sizeof(*ev)+len);
+  trace_pending = 1;
 }
 
+static void
+debug_input(int portno, int status, int chan, int data, int data2)
+{
+  TraceEvent ev = { .type = TRACE_INPUT, .portno = portno,
+		    .status = status, .chan = chan, .shift = shift,
+		    .data = data, .data2 = data2 };
+  queue_trace(&ev, NULL, 0, 0);
+}
+
+static void
+debug_output(translation *tr, stroke *s, int status, int chan, int data,
+	      int data2, int index, int dir,
+	      int mod, int step, int n_steps, int *steps)
+{
+  TraceEvent ev = { .type = TRACE_KEYS, .status = status, .chan = chan,
+		    .index = index, .dir = dir, .shift = shift,
+		    .data = data, .data2 = data2, .mod = mod, .step = step,
+		    .n_steps = n_steps, .steps = steps, .tr = tr, .s = s };
+  queue_trace(&ev, NULL, 0, 0);
+}
+
+static void debug_section(translation *tr)
+{
+  // we do some caching of the last printed translation here, so that we don't
+  // print the same message twice
+  if (debug_regex && (!last_window || tr != last_translation)) {
+    TraceEvent ev = { .type = TRACE_SECTION, .tr = tr };
+    char names[2*MAX_WINNAME_SIZE];
+    int l = strlen(last_window_name)+1, l2 = strlen(last_window_class)+1;
+    last_translation = tr;
+    last_window = 1;
+    memcpy(names, last_window_name, l);
+    memcpy(names+l, last_window_class, l2);
+    queue_trace(&ev, names, l+l2, 0);
+  }
+}
+
+// Wake up the trace thread after a batch of events.
+static void
+flush_trace(void)
+{
+  if (trace_running && trace_pending) {
+    trace_pending = 0;
+    sem_post(&trace_sem);
+  }
+}
+
+// Wait until the trace thread has processed all pending records. This is
+// called before a configuration gets replaced.
+void
+sync_trace(void)
+{
+  TraceEvent ev = { .type = TRACE_SYNC };
+  if (!trace_running) return;
+  queue_trace(&ev, NULL, 0, 1);
+  flush_trace();
+  sem_wait(&trace_sync_sem);
+}
+
+static void
+init_trace(void)
+{
+  trace_queue = jack_ringbuffer_create(TRACE_QUEUE_SIZE*sizeof(TraceEvent));
+  if (!trace_queue) {
+    fprintf(stderr, "cannot create trace queue, debugging output will be synchronous\n");
+    return;
+  }
+  jack_ringbuffer_mlock(trace_queue);
+  if (sem_init(&trace_sem, 0, 0)) {
+    perror("sem_init");
+    goto errout;
+  }
+  if (sem_init(&trace_sync_sem, 0, 0)) {
+    perror("sem_init");
+    sem_destroy(&trace_sem);
+    goto errout;
+  }
+  if (pthread_create(&trace_thread, NULL, trace_thread_proc, NULL)) {
+    perror("pthread_create");
+    sem_destroy(&trace_sem);
+    sem_destroy(&trace_sync_sem);
+    goto errout;
+  }
+  trace_running = 1;
+  return;
+ errout:
+  jack_ringbuffer_free(trace_queue);
+  trace_queue = NULL;
+}
+
+static void
+close_trace(void)
+{
+  TraceEvent ev = { .type = TRACE_QUIT };
+  if (!trace_running) return;
+  queue_trace(&ev, NULL, 0, 1);
+  sem_post(&trace_sem);
+  pthread_join(trace_thread, NULL);
+  trace_running = 0;
+  sem_destroy(&trace_sem);
+  sem_destroy(&trace_sync_sem);
+  jack_ringbuffer_free(trace_queue);
+  trace_queue = NULL;
+}
+
+// Get the tag of a rule for the latency statistics, adding it to the table
+// if needed, and count the hit. This is only called from the main thread.
+static int rule_tag(translation *tr, stroke *s, int status, int chan, int data,
+		    int index, int dir, int fallback)
+{
+  uint32_t h = (uintptr_t)tr >> 4;
+  int n = MAX_RULE_STATS-2;
+  h = h*31 + status; h = h*31 + chan; h = h*31 + data;
+  h = h*31 + shift; h = h*31 + index*3 + dir+1;
+  for (int i = 0, j = 1 + h%n; i < n; i++, j = j%n + 1) {
+    RuleStats *r = &rule_stats[j];
+    if (!r->used) {
+      r->tr = tr; r->s = s;
+      strncpy(r->section, tr->name, sizeof(r->section)-1);
+      r->status = status; r->chan = chan; r->data = data;
+      r->shift = shift; r->index = index; r->dir = dir;
+      debug_key(tr, shift, r->rule, status, chan, data, dir);
+      if (!dir) strcat(r->rule, index?"[U]":"[D]");
+      r->used = 1;
+      r->hits++;
+      r->fallbacks += fallback;
+      return j;
+    } else if (r->tr == tr && r->status == status && r->chan == chan &&
+	       r->data == data && r->shift == shift && r->index == index &&
+	       r->dir == dir &&
+	       // the section may have been replaced by a different one at
+	       // the same address
+	       !strncmp(r->section, tr->name, sizeof(r->section)-1)) {
+      r->hits++;
+      r->fallbacks += fallback;
+      return j;
+    }
+  }
+  // table is full
+  rule_stats[MAX_RULE_STATS-1].hits++;
+  rule_stats[MAX_RULE_STATS-1].fallbacks += fallback;
+  return MAX_RULE_STATS-1;
+}
+
+// Count a message without a translation, which is passed through if passed
+// is set, dropped otherwise. This is only called from the main thread.
+static void count_untranslated(int portno, int status, int chan, int data,
+			       int passed)
+{
+  uint32_t h = portno;
+  int n = MAX_MSG_STATS-1;
+  MsgStats *m = &msg_stats[MAX_MSG_STATS-1];
+  if (status >= 0xd0) data = 0;
+  h = h*31 + status; h = h*31 + chan; h = h*31 + data;
+  for (int i = 0, j = h%n; i < n; i++, j = (j+1)%n) {
+    MsgStats *m2 = &msg_stats[j];
+    if (!m2->used) {
+      m2->used = 1; m2->portno = portno; m2->status = status;
+      m2->chan = chan; m2->data = data;
+      m = m2;
+      break;
+    } else if (m2->portno == portno && m2->status == status &&
+	       m2->chan == chan && m2->data == data) {
+      m = m2;
+      break;
+    }
+  }
+  if (passed)
+    m->passed++;
+  else
+    m->missed++;
+}
+
+// Upper bound of the given percentile (in 1/1000) of the latencies in a
+// histogram with the given number of measurements.
+static uint32_t latency_percentile(RuleStats *r, uint32_t count, int permille)
+{
+  uint32_t rank = count - (uint64_t)count*(1000-permille)/1000, n = 0;
+  uint32_t max = __atomic_load_n(&r->max, __ATOMIC_RELAXED);
+  if (!rank) return 0;
+  for (int i = 0; i < N_LATENCY_BUCKETS; i++) {
+    n += __atomic_load_n(&r->buckets[i], __ATOMIC_RELAXED);
+    if (n >= rank) {
+      uint32_t v = latency_limit(i);
+      return v > max ? max : v;
+    }
+  }
+  return max;
+}
+
+static void print_latencies(int indent, char *name, RuleStats *r)
+{
+  uint32_t count = __atomic_load_n(&r->count, __ATOMIC_RELAXED);
+  uint32_t max = __atomic_load_n(&r->max, __ATOMIC_RELAXED);
+  printf("%*s%-*s %8u %8u %8u %8u %8u\n", indent, "", 32-indent, name,
+	 r->hits, count, latency_percentile(r, count, 500),
+	 latency_percentile(r, count, 990), max);
+}
+
+// Print the latency statistics, per section and rule. Sections are
+// identified by name here, so that the statistics of a section carry over
+// when the configuration is reloaded. The percentiles are upper bounds,
+// given the resolution of the histograms.
+static void print_latency_stats(void)
+{
+  RuleStats total;
+  char name[100];
+  int i, j, k;
+  printf("%-32s %8s %8s %8s %8s %8s\n", "latency (usecs)",
+	 "hits", "output", "p50", "p99", "max");
+  if (rule_stats[0].count)
+    print_latencies(0, "(pass-through)", &rule_stats[0]);
+  for (i = 1; i < MAX_RULE_STATS-1; i++) {
+    RuleStats *r = &rule_stats[i];
+    if (!r->used) continue;
+    // skip sections we have already printed
+    for (j = 1; j < i; j++)
+      if (rule_stats[j].used && !strcmp(rule_stats[j].section, r->section))
+	break;
+    if (j < i) continue;
+    // add up the histograms of all rules in the section
+    memset(&total, 0, sizeof(total));
+    for (j = i; j < MAX_RULE_STATS-1; j++) {
+      RuleStats *r2 = &rule_stats[j];
+      uint32_t max;
+      if (!r2->used || strcmp(r2->section, r->section)) continue;
+      total.hits += r2->hits;
+      total.count += __atomic_load_n(&r2->count, __ATOMIC_RELAXED);
+      max = __atomic_load_n(&r2->max, __ATOMIC_RELAXED);
+      if (max > total.max) total.max = max;
+      for (k = 0; k < N_LATENCY_BUCKETS; k++)
+	total.buckets[k] += __atomic_load_n(&r2->buckets[k], __ATOMIC_RELAXED);
+    }
+    snprintf(name, sizeof(name), "[%s]", r->section);
+    print_latencies(0, name, &total);
+    for (j = i; j < MAX_RULE_STATS-1; j++) {
+      RuleStats *r2 = &rule_stats[j];
+      if (!r2->used || strcmp(r2->section, r->section)) continue;
+      print_latencies(2, r2->rule, r2);
+    }
+  }
+  if (rule_stats[MAX_RULE_STATS-1].hits)
+    print_latencies(0, "(other)", &rule_stats[MAX_RULE_STATS-1]);
+  fflush(stdout);
+}
+
+// Runtime statistics and state, as reported by the control socket (see
+// control.c). These are printed as lines of the form 'name value'.
+void
+print_stats(FILE *fp)
+{
+  static RuleStats total;
+  translation *tr = last_window_translation;
+  int i, k;
+
+  fprintf(fp, "uptime %ld\n", (long)(time(0) - start_time));
+  for (k = 0; k < 2; k++)
+    fprintf(fp, "midi_in.%d %lu\n", k+1, events_in[k]);
+  for (k = 0; k < 2; k++)
+    fprintf(fp, "midi_out.%d %lu\n", k+1, events_out[k]);
+  fprintf(fp, "keys_out %lu\n", keys_out);
+  fprintf(fp, "keys_dropped %lu\n", keys_dropped);
+  fprintf(fp, "lost_in %lu\n", seq.lost_in);
+  fprintf(fp, "lost_out %lu\n", seq.lost_out);
+  fprintf(fp, "trace_skipped %lu\n", trace_skipped);
+  fprintf(fp, "reloads %lu\n", config_loads);
+  fprintf(fp, "reload_errors %lu\n", config_rejects);
+  fprintf(fp, "cache_hits %lu\n",
+	  __atomic_load_n(&config_cache_hits, __ATOMIC_RELAXED));
+  fprintf(fp, "cache_misses %lu\n",
+	  __atomic_load_n(&config_cache_misses, __ATOMIC_RELAXED));
+  fprintf(fp, "focus_queries %lu\n", focus_queries);
+  fprintf(fp, "focus_changes %lu\n", focus_changes);
+  fprintf(fp, "window_class %s\n", last_focused_window?last_window_class:"");
+  fprintf(fp, "window_title %s\n", last_focused_window?last_window_name:"");
+  fprintf(fp, "section %s\n", tr?tr->name:"");
+  fprintf(fp, "shift %d\n", shift);
+  // latencies of all rules together
+  memset(&total, 0, sizeof(total));
+  for (i = 0; i < MAX_RULE_STATS; i++) {
+    RuleStats *r = &rule_stats[i];
+    uint32_t max = __atomic_load_n(&r->max, __ATOMIC_RELAXED);
+    total.count += __atomic_load_n(&r->count, __ATOMIC_RELAXED);
+    if (max > total.max) total.max = max;
+    for (k = 0; k < N_LATENCY_BUCKETS; k++)
+      total.buckets[k] += __atomic_load_n(&r->buckets[k], __ATOMIC_RELAXED);
+  }
+  fprintf(fp, "latency_count %u\n", total.count);
+  fprintf(fp, "latency_p50 %u\n", latency_percentile(&total, total.count, 500));
+  fprintf(fp, "latency_p90 %u\n", latency_percentile(&total, total.count, 900));
+  fprintf(fp, "latency_p99 %u\n", latency_percentile(&total, total.count, 990));
+  fprintf(fp, "latency_max %u\n", total.max);
+}
+
+static void
+print_value_array(FILE *fp, char *name, int16_t values[2][16][128], int def)
+{
+  int k, chan, i;
+  for (k = 0; k < 2; k++)
+    for (chan = 0; chan < 16; chan++) {
+      for (i = 0; i < 128 && values[k][chan][i] == def; i++) ;
+      if (i == 128) continue;
+      fprintf(fp, "%s.%d.%d", name, k+1, chan+1);
+      for (i = 0; i < 128; i++)
+	fprintf(fp, " %d", values[k][chan][i]);
+      fputc('\n', fp);
+    }
+}
+
+// The cached controller values, per output port and MIDI channel. Only the
+// channels with non-default values are listed.
+void
+print_values(FILE *fp)
+{
+  int k, chan;
+  print_value_array(fp, "note", notevalue, 0);
+  print_value_array(fp, "cc", ccvalue, 0);
+  print_value_array(fp, "kp", kpvalue, 0);
+  for (k = 0; k < 2; k++)
+    for (chan = 0; chan < 16; chan++) {
+      if (cpvalue[k][chan])
+	fprintf(fp, "cp.%d.%d %d\n", k+1, chan+1, cpvalue[k][chan]);
+      if (pbvalue[k][chan] != 8192)
+	fprintf(fp, "pb.%d.%d %d\n", k+1, chan+1, pbvalue[k][chan]);
+    }
+}
+
+static int rule_hits_cmp(const void *a, const void *b)
+{
+  uint32_t x = rule_stats[*(const int*)a].hits;
+  uint32_t y = rule_stats[*(const int*)b].hits;
+  return x < y ? 1 : x > y ? -1 : *(const int*)a - *(const int*)b;
+}
+
+static int msg_count_cmp(const void *a, const void *b)
+{
+  const MsgStats *m = &msg_stats[*(const int*)a];
+  const MsgStats *m2 = &msg_stats[*(const int*)b];
+  uint32_t x = m->missed + m->passed, y = m2->missed + m2->passed;
+  return x < y ? 1 : x > y ? -1 : *(const int*)a - *(const int*)b;
+}
+
+// Check whether the given rule has been used.
+static int rule_used(translation *tr, stroke *s)
+{
+  for (int i = 1; i < MAX_RULE_STATS-1; i++) {
+    RuleStats *r = &rule_stats[i];
+    if (r->used && r->s == s && r->tr == tr &&
+	!strncmp(r->section, tr->name, sizeof(r->section)-1))
+      return 1;
+  }
+  return 0;
+}
+
+// Rule statistics, as reported by the control socket (see control.c). We
+// print a line 'hit count fallbacks [section] rule' for each rule which has
+// been used, most frequently used rules first, where fallbacks is the
+// number of times the rule was used because the section of the focused
+// window didn't have a translation of its own. This is followed by a line
+// 'unused [section] rule' for each rule of the current configuration which
+// hasn't been used yet, and a line 'untranslated dropped passed port
+// message' for each message without a translation, with the number of
+// times it was dropped and passed through, respectively. The statistics are
+// kept across configuration reloads, so the hit list may contain rules
+// which don't exist anymore.
+void
+print_rule_stats(FILE *fp)
+{
+  static const int kind_status[N_KINDS] =
+    { 0x90, 0x90, 0xc0, 0xb0, 0xb0, 0xe0, 0xe0, 0xa0, 0xa0, 0xd0, 0xd0 };
+  static const int kind_incr[N_KINDS] = { 0, 1, 0, 0, 1, 0, 1, 0, 1, 0, 1 };
+  static int idx[MAX_RULE_STATS > MAX_MSG_STATS ?
+		 MAX_RULE_STATS : MAX_MSG_STATS];
+  translation_set *ts = get_translation_set();
+  char name[256];
+  int i, n, k, kind, index;
+
+  for (i = 1, n = 0; i < MAX_RULE_STATS-1; i++)
+    if (rule_stats[i].used) idx[n++] = i;
+  qsort(idx, n, sizeof(int), rule_hits_cmp);
+  for (i = 0; i < n; i++) {
+    RuleStats *r = &rule_stats[idx[i]];
+    fprintf(fp, "hit %u %u [%s] %s\n", r->hits, r->fallbacks,
+	    r->section, r->rule);
+  }
+  if (rule_stats[MAX_RULE_STATS-1].hits)
+    // the table overflowed, so some rules may be reported as unused below
+    fprintf(fp, "hit %u %u (other)\n", rule_stats[MAX_RULE_STATS-1].hits,
+	    rule_stats[MAX_RULE_STATS-1].fallbacks);
+  for (i = 0; ts && i < ts->n_sections; i++) {
+    translation *tr = ts->sections[i];
+    for (kind = 0; kind < N_KINDS; kind++)
+      for (k = 0; k < N_ST; k++) {
+	uint16_t m;
+	stroke_data *sd = get_stroke_data(tr, kind, k, &m);
+	for (int j = 0; j < m; j++)
+	  for (index = 0; index < 2; index++) {
+	    int status = kind_status[kind];
+	    int dir = kind_incr[kind] ? (index ? 1 : -1) : 0;
+	    if (!sd[j].s[index] || rule_used(tr, sd[j].s[index])) continue;
+	    debug_key(tr, k, name, status, sd[j].chan, sd[j].data, dir);
+	    if (!dir) strcat(name, index?"[U]":"[D]");
+	    fprintf(fp, "unused [%s] %s\n", tr->name, name);
+	  }
+      }
+  }
+  for (i = 0, n = 0; i < MAX_MSG_STATS; i++)
+    if (msg_stats[i].missed || msg_stats[i].passed) idx[n++] = i;
+  qsort(idx, n, sizeof(int), msg_count_cmp);
+  for (i = 0; i < n; i++) {
+    MsgStats *m = &msg_stats[idx[i]];
+    if (m->used)
+      fprintf(fp, "untranslated %u %u %d %s\n", m->missed, m->passed,
+	      m->portno+1,
+	      debug_key(0, 0, name, m->status, m->chan, m->data, 0));
+    else
+      fprintf(fp, "untranslated %u %u (other)\n", m->missed, m->passed);
+  }
+}
+
+#ifdef PROFILE
+uint64_t prof_cycles[N_PROF], prof_calls[N_PROF];
+
+static const char *prof_names[N_PROF] = {
+  "handle_event", "pop_midi", "focus", "lookup", "send_midi", "queue_midi",
+  "send_key", "key output", "key flush", "config load", "config install"
+};
+
+// Print the per-stage costs. The times are inclusive, e.g., send_midi
+// includes queue_midi and, in the case of macros, recursive handle_event
+// calls. The stages from pop_midi to send_key are also given as a
+// percentage of the total time spent in handle_event; key output and flush
+// happen in the output thread, the config load in the reload thread.
+void
+print_profile(void)
+{
+  int i;
+  printf("%-16s %10s %14s %12s %7s\n", "stage", "calls", PROF_UNIT,
+	 PROF_UNIT"/call", "%");
+  for (i = 0; i < N_PROF; i++) {
+    printf("%-16s %10llu %14llu %12.0f", prof_names[i],
+	   (unsigned long long)prof_calls[i],
+	   (unsigned long long)prof_cycles[i],
+	   prof_calls[i] ? (double)prof_cycles[i]/prof_calls[i] : 0.0);
+    if (i > PROF_EVENT && i <= PROF_SEND_KEY && prof_cycles[PROF_EVENT])
+      printf(" %6.1f%%\n", 100.0*prof_cycles[i]/prof_cycles[PROF_EVENT]);
+    else
+      printf("\n");
+  }
+  fflush(stdout);
+}
+#endif
+
 // Some machinery to handle the debugging of section matches. This is
 // necessary since some inputs may generate a lot of calls to send_strokes()
 // without ever actually matching any output sequence at all. In such cases we
 // want to prevent a cascade of useless debugging messages by handling the
-// message printing in a lazy manner.
+// message printing in a lazy manner. The same logic also tells us which
+// messages went untranslated for the rule statistics, so this is done even
+// if debugging output is disabled.
 
 static int debug_state = 0, debug_count = 0;
 static translation *debug_tr = NULL;
+static int debug_portno, debug_status, debug_chan, debug_data;
 
 static void start_debug()
 {
   // start a debugging section
-  debug_state = debug_regex;
+  debug_state = 1;
   debug_tr = NULL;
   debug_count = 0;
 }
@@ -756,12 +1845,26 @@ static void start_debug()
 static void end_debug()
 {
   // end a debugging section; if we still haven't matched an output sequence,
-  // but processed any input at all, we print the last matched translation
-  // section now anyway
-  if (debug_state && debug_count) debug_section(debug_tr);
+  // but processed any input at all, the message went untranslated, and we
+  // print the last matched translation section now anyway
+  if (debug_state && debug_count) {
+    count_untranslated(debug_portno, debug_status, debug_chan, debug_data, 0);
+    if (debug_regex) debug_section(debug_tr);
+  }
   debug_state = 0;
 }
 
+// Record an unsuccessful lookup in send_strokes(), see above.
+static void debug_nomatch(translation *tr, int portno, int status, int chan,
+			  int data)
+{
+  debug_tr = tr;
+  debug_portno = portno; debug_status = status;
+  debug_chan = chan; debug_data = data;
+  // record that we actually tried to process some input
+  debug_count = 1;
+}
+
 // maximum recursion depth
 #define MAX_DEPTH 32
 
@@ -789,6 +1892,41 @@ static int toggle_msg(uint8_t msg[3])
 }
 
 
+// Key events are buffered in the output queue and flushed once per batch of
+// input events (see main() below), rather than after each translation,
+// to save system calls and X server load during bursts of input. To keep
+// latency in check during long batches, we also flush as soon as the oldest
+// unflushed key event is older than MAX_FLUSH_DELAY.
+
+// maximum delay in microsec before buffered key events get flushed
+#define MAX_FLUSH_DELAY 2000
+
+static int keys_pending = 0;
+static uint64_t keys_time;
+
+static void flush_keys(void)
+{
+  // This is called on each iteration of the main loop, so this is where
+  // postponed key releases get retried.
+  if (out_releases_pending && queue_releases()) keys_pending = 1;
+  if (keys_pending) {
+    if (out_running) {
+      queue_output(OUT_FLUSH, 0, 0);
+      sem_post(&out_sem);
+    } else {
+      output_flush(display);
+      flush_pending_keys(&sync_keys);
+    }
+    keys_pending = 0;
+  }
+}
+
+static void check_flush_keys(void)
+{
+  if (keys_pending && get_usecs() - keys_time >= MAX_FLUSH_DELAY)
+    flush_keys();
+}
+
 int
 check_strokes(translation *tr, uint8_t portno, int status, int chan, int data)
 {
@@ -823,6 +1961,8 @@ send_strokes(translation *tr, uint8_t portno, int status, int chan,
 	     int data, int data2, int index, int dir, int depth)
 {
   int nkeys = 0, step = 0, n_steps = 0, *steps = 0, is_incr = 0, mod = 0;
+  // section of the focused window, if any, for the fallback statistics
+  translation *tr0 = tr;
   stroke *s = fetch_stroke(tr, portno, status, chan, data, index, dir,
 			   &step, &n_steps, &steps, &is_incr, &mod);
   // If there's no press/release translation, check whether we have got at
@@ -841,7 +1981,10 @@ send_strokes(translation *tr, uint8_t portno, int status, int chan,
       (!dir && fetch_stroke(tr, portno, status, chan, data, !index, dir, 0, 0, 0, 0, 0));
     // Ignore all MIDI input on the second port if no translation was found in
     // the [MIDI2] section (or the section is missing altogether).
-    if (portno && !s) return;
+    if (portno && !s) {
+      if (!chk) debug_nomatch(tr, portno, status, chan, data);
+      return;
+    }
   }
 
   if (!s) {
@@ -853,30 +1996,29 @@ send_strokes(translation *tr, uint8_t portno, int status, int chan,
       (!dir && fetch_stroke(tr, portno, status, chan, data, !index, dir, 0, 0, 0, 0, 0));
   }
 
-  if (debug_regex) {
-    if (s) {
-      // found a sequence, print the matching section now
-      debug_section(tr);
-      debug_state = 0;
-    } else if (!chk) {
-      // No matches yet. To prevent a cascade of spurious messages, we defer
-      // printing the matched section for now and just record it instead; it
-      // may then be printed later.
-      debug_tr = tr;
-      // record that we actually tried to process some input
-      debug_count = 1;
-    }
+  if (s) {
+    // found a sequence, print the matching section now
+    if (debug_regex) debug_section(tr);
+    debug_state = 0;
+  } else if (!chk) {
+    // No matches yet. To prevent a cascade of spurious messages, we defer
+    // printing the matched section for now and just record it instead; it
+    // may then be printed later.
+    debug_nomatch(tr, portno, status, chan, data);
   }
 
-  if (s && debug_keys) {
-    char name[100];
-    print_stroke_sequence(debug_key(tr, name, status, chan, data, dir),
-			  (dir||mod)?"":index?"U":"D", s,
-			  mod, step, n_steps, steps, data2);
-  }
+  if (s && debug_keys)
+    debug_output(tr, s, status, chan, data, data2, index, dir,
+		 mod, step, n_steps, steps);
+  // output gets tagged with the rule, for the latency statistics
+  int tag = event_tag;
+  if (s) event_tag = rule_tag(tr, s, status, chan, data, index, dir,
+			     tr0 && tr != tr0);
   while (s) {
     if (s->keysym) {
-      send_key(s->keysym, s->press);
+      PROF_BEGIN(prof_t);
+      send_key(s->keysym, s->keycode, s->press);
+      PROF_END(PROF_SEND_KEY, prof_t);
       nkeys++;
     } else if (s->shift) {
       // toggle shift status
@@ -884,7 +2026,7 @@ send_strokes(translation *tr, uint8_t portno, int status, int chan,
 	if (shift) {
 	  // reset current shift feedback
 	  if (toggle_msg(shift_fb[shift-1]))
-	    queue_midi(&seq, shift_fb[shift-1], 1);
+	    output_midi(shift_fb[shift-1], 1, event_tag);
 	  memset(shift_fb[shift-1], 0, 3);
 	}
 	shift = s->shift;
@@ -894,14 +2036,15 @@ send_strokes(translation *tr, uint8_t portno, int status, int chan,
       // do nothing (NOP)
       ;
     } else {
+      PROF_BEGIN(prof_t);
       if (s->recursive && depth >= MAX_DEPTH) {
 	char name[100];
 	if (tr && tr->name)
 	  fprintf(stderr, "Error: [%s]$%s: recursion too deep\n",
-		  tr->name, debug_key(tr, name, status, chan, data, dir));
+		  tr->name, debug_key(tr, shift, name, status, chan, data, dir));
 	else
 	  fprintf(stderr, "Error: $%s: recursion too deep\n",
-		  debug_key(tr, name, status, chan, data, dir));
+		  debug_key(tr, shift, name, status, chan, data, dir));
       } else if (s->feedback) {
 	if (!s->recursive && jack_num_outputs > 1) {
 	  if (s->feedback == 1)
@@ -919,77 +2062,85 @@ send_strokes(translation *tr, uint8_t portno, int status, int chan,
 	send_midi(portno, s, index, dir, mod,
 		  step, n_steps, steps, data2, depth, 0);
       }
+      PROF_END(PROF_SEND_MIDI, prof_t);
     }
     s = s->next;
   }
+  event_tag = tag;
   // no need to flush the display if we didn't send any keys
   if (nkeys) {
-    XFlush(display);
+    if (!keys_pending) keys_time = get_usecs();
+    keys_pending += nkeys;
   }
 }
 
-char *
-get_window_name(Window win)
+// Fetch a window property into the given buffer, which is assumed to have
+// room for MAX_WINNAME_SIZE bytes. Returns 1 if the window has the property,
+// 0 otherwise (or if the request failed).
+static int
+get_window_property(Window win, Atom prop, Atom req_type, char *buf)
 {
-  Atom prop = XInternAtom(display, "WM_NAME", False);
   Atom type;
   int form;
   unsigned long remain, len;
-  unsigned char *list;
+  unsigned char *list = NULL;
 
-  if (XGetWindowProperty(display, win, prop, 0, 1024, False,
-			 AnyPropertyType, &type, &form, &len, &remain,
+  *buf = 0;
+  if (prop == None) return 0;
+  // the length is in 32 bit units
+  if (XGetWindowProperty(display, win, prop, 0, MAX_WINNAME_SIZE/4, False,
+			 req_type, &type, &form, &len, &remain,
 			 &list) != Success) {
     fprintf(stderr, "XGetWindowProperty failed for window 0x%x\n", (int)win);
-    return NULL;
+    return 0;
   }
-
-  return (char*)list;
-}
-
-char *
-get_window_class(Window win)
-{
-  Atom prop = XInternAtom(display, "WM_CLASS", False);
-  Atom type;
-  int form;
-  unsigned long remain, len;
-  unsigned char *list;
-
-  if (XGetWindowProperty(display, win, prop, 0, 1024, False,
-			 AnyPropertyType, &type, &form, &len, &remain,
-			 &list) != Success) {
-    fprintf(stderr, "XGetWindowProperty failed for window 0x%x\n", (int)win);
-    return NULL;
+  // If the property exists, but has a different type than the one we asked
+  // for, the server returns its actual type and no data. Only 8 bit data is
+  // meaningful here. In either case we report failure, so that the caller
+  // can try another property.
+  if (type == None || (req_type != AnyPropertyType && type != req_type) ||
+      form != 8) {
+    if (list) XFree(list);
+    return 0;
   }
-
-  return (char*)list;
+  if (list) {
+    // Note that WM_CLASS actually consists of two strings (instance and
+    // class name), we just take the first one.
+    if (len > MAX_WINNAME_SIZE-1) len = MAX_WINNAME_SIZE-1;
+    memcpy(buf, list, len);
+    buf[len] = 0;
+    XFree(list);
+  }
+  return 1;
 }
 
-char *
-walk_window_tree(Window win, char **window_class)
+// Find the name and class of the given window, walking up the window tree
+// until we find a window which has a name. The name is taken from
+// _NET_WM_NAME if available (which is always UTF-8), WM_NAME otherwise.
+// Returns 1 if a named window was found, 0 otherwise.
+static int
+walk_window_tree(Window win, char *window_name, char *window_class)
 {
-  char *window_name;
   Window root = 0;
   Window parent;
   Window *children;
   unsigned int nchildren;
 
   while (win != root) {
-    window_name = get_window_name(win);
-    if (window_name != NULL) {
-      *window_class = get_window_class(win);
-      return window_name;
+    if (get_window_property(win, net_wm_name, utf8_string, window_name) ||
+	get_window_property(win, XA_WM_NAME, AnyPropertyType, window_name)) {
+      get_window_property(win, XA_WM_CLASS, XA_STRING, window_class);
+      return 1;
     }
     if (XQueryTree(display, win, &root, &parent, &children, &nchildren)) {
       win = parent;
-      XFree(children);
+      if (children) XFree(children);
     } else {
       fprintf(stderr, "XQueryTree failed for window 0x%x\n", (int)win);
-      return NULL;
+      return 0;
     }
   }
-  return NULL;
+  return 0;
 }
 
 translation *
@@ -997,36 +2148,47 @@ get_focused_window_translation()
 {
   Window focus;
   int revert_to;
-  char *window_name = NULL, *window_class = NULL;
 
+  // XGetInputFocus() is a round trip to the server, which also flushes the
+  // output queue, so we only do this once per batch of input events.
+  if (focus_valid || !display) return last_window_translation;
+  focus_valid = 1;
+  focus_queries++;
   XGetInputFocus(display, &focus, &revert_to);
   if (focus != last_focused_window) {
+    focus_changes++;
     last_window = 0;
     last_focused_window = focus;
-    window_name = walk_window_tree(focus, &window_class);
-    last_window_translation = get_translation(window_name, window_class);
-    if (window_name && *window_name) {
-      strncpy(last_window_name, window_name, MAX_WINNAME_SIZE);
-      last_window_name[MAX_WINNAME_SIZE-1] = 0;
-    } else {
-      strcpy(last_window_name, "Unnamed");;
-    }
-    if (window_class && *window_class) {
-      strncpy(last_window_class, window_class, MAX_WINNAME_SIZE);
-      last_window_class[MAX_WINNAME_SIZE-1] = 0;
-    } else {
-      strcpy(last_window_name, "Unnamed");;
-    }
-    if (window_name != NULL) {
-      XFree(window_name);
-    }
-    if (window_class != NULL) {
-      XFree(window_class);
-    }
+    // The name and class go straight into our static buffers, so that no
+    // further allocations or copies are needed.
+    if (!walk_window_tree(focus, last_window_name, last_window_class))
+      *last_window_name = *last_window_class = 0;
+    capture_focus(event_frames, last_window_class, last_window_name);
+    last_window_translation =
+      get_translation(last_window_name, last_window_class);
+    if (!*last_window_name)
+      strcpy(last_window_name, "Unnamed");
+    if (!*last_window_class)
+      strcpy(last_window_class, "Unnamed");
   }
   return last_window_translation;
 }
 
+// Set the focused window from a replay script or capture (see replay.c).
+void
+set_replay_focus(char *win_class, char *win_title)
+{
+  last_window = 0;
+  snprintf(last_window_name, MAX_WINNAME_SIZE, "%s", win_title);
+  snprintf(last_window_class, MAX_WINNAME_SIZE, "%s", win_class);
+  last_window_translation =
+    get_translation(last_window_name, last_window_class);
+  if (!*last_window_name)
+    strcpy(last_window_name, "Unnamed");
+  if (!*last_window_class)
+    strcpy(last_window_class, "Unnamed");
+}
+
 static int8_t innotevalue[2][16][128];
 static int8_t inccvalue[2][16][128];
 static int8_t inkpvalue[2][16][128];
@@ -1358,7 +2520,7 @@ check_recursive(int status, int chan, int data, int recursive)
   if (recursive) {
     char name[100];
     fprintf(stderr, "Warning: $%s: undefined macro\n",
-	    debug_key(0, name, status, chan, data, 0));
+	    debug_key(0, shift, name, status, chan, data, 0));
   }
   return recursive;
 }
@@ -1366,7 +2528,9 @@ check_recursive(int status, int chan, int data, int recursive)
 void
 handle_event(uint8_t *msg, uint8_t portno, int depth, int recursive)
 {
+  PROF_BEGIN(prof_t);
   translation *tr = get_focused_window_translation();
+  PROF_END(PROF_FOCUS, prof_t);
 
   //fprintf(stderr, "midi [%d]: %0x %0x %0x\n", portno, msg[0], msg[1], msg[2]);
   int status = msg[0] & 0xf0, chan = msg[0] & 0x0f;
@@ -1380,7 +2544,10 @@ handle_event(uint8_t *msg, uint8_t portno, int depth, int recursive)
     debug_input(portno, status, chan, msg[1], msg[2]);
   if (passthrough[portno] &&
       !check_strokes(tr, portno, status, chan, status>=0xd0?0:msg[1])) {
-    queue_midi(&seq, msg, portno);
+    // tag 0 = pass-through
+    rule_stats[0].hits++;
+    count_untranslated(portno, status, chan, msg[1], 1);
+    output_midi(msg, portno, 0);
     return;
   }
   switch (status) {
@@ -1609,9 +2776,10 @@ handle_event(uint8_t *msg, uint8_t portno, int depth, int recursive)
 
 void help(char *progname)
 {
-  fprintf(stderr, "Usage: %s [-hkn] [-d[rskmj]] [-ost[n]] [-j name] [-P[prio]] [[-r] rcfile]\n", progname);
+  fprintf(stderr, "Usage: %s [-chknu] [-d[rskmjl]] [-ost[n]] [-j name] [-P[prio]] [--capture file] [--control socket] [--replay file [--focus file] [--out file]] [[-r] rcfile]\n", progname);
   fprintf(stderr, "-h print this message\n");
-  fprintf(stderr, "-d debug (r = regex, s = strokes, k = keys, m = midi, j = jack; default: all)\n");
+  fprintf(stderr, "-c, --check check the config file and exit\n");
+  fprintf(stderr, "-d debug (r = regex, s = strokes, k = keys, m = midi, j = jack, l = latency; default: all)\n");
   fprintf(stderr, "-j jack client name (default: midizap)\n");
   fprintf(stderr, "-k keep track of key status (ignore double on/off messages)\n");
   fprintf(stderr, "-n no automatic feedback from the second port (-o2)\n");
@@ -1620,6 +2788,12 @@ void help(char *progname)
   fprintf(stderr, "-r config file name (default: MIDIZAP_CONFIG_FILE variable or ~/.midizaprc)\n");
   fprintf(stderr, "-s pass-through of system messages (n = 0-2; default: all ports)\n");
   fprintf(stderr, "-t pass-through of untranslated messages (n = 0-2; default: all ports)\n");
+  fprintf(stderr, "-u key and mouse output through uinput instead of XTest\n");
+  fprintf(stderr, "--replay file replay a MIDI file or capture without Jack and X\n");
+  fprintf(stderr, "--focus file window focus script for --replay\n");
+  fprintf(stderr, "--out file output file for --replay (default: stdout)\n");
+  fprintf(stderr, "--capture file record all MIDI input and focus changes for --replay\n");
+  fprintf(stderr, "--control socket serve runtime statistics on a Unix socket\n");
 }
 
 uint8_t quit = 0;
@@ -1629,6 +2803,11 @@ void quitter()
     quit = 1;
 }
 
+void dumper()
+{
+    dump_latency = 1;
+}
+
 // Helper functions to process the command line, so that we can pass it to
 // Jack session management.
 
@@ -1684,23 +2863,54 @@ static char *absolute_path(char *name)
 // poll interval in microsec (this shouldn't be too large to avoid jitter)
 #define POLL_INTERVAL 1000
 
-#include <time.h>
-#include <pthread.h>
-
 int
 main(int argc, char **argv)
 {
   uint8_t msg[3];
-  int opt, prio = 0;
+  int opt, prio = 0, check = 0;
+  char *replay_name = NULL, *focus_name = NULL, *out_name = NULL;
+  char *capture_name = NULL, *control_name = NULL;
+  static struct option long_options[] = {
+    { "check", no_argument, 0, 'c' },
+    { "help", no_argument, 0, 'h' },
+    // these have no short forms
+    { "replay", required_argument, 0, 'R' },
+    { "focus", required_argument, 0, 'F' },
+    { "out", required_argument, 0, 'O' },
+    { "capture", required_argument, 0, 'C' },
+    { "control", required_argument, 0, 'S' },
+    { 0, 0, 0, 0 }
+  };
 
   // Start recording the command line to be passed to Jack session management.
   add_command(argv[0], 0);
 
-  while ((opt = getopt(argc, argv, "hkno::d::j:r:P::s::t::")) != -1) {
+  while ((opt = getopt_long(argc, argv, "chknuo::d::j:r:P::s::t::",
+			    long_options, NULL)) != -1) {
     switch (opt) {
     case 'h':
       help(argv[0]);
       exit(0);
+    case 'c':
+      check = 1;
+      break;
+    case 'R':
+      replay_name = optarg;
+      break;
+    case 'F':
+      focus_name = optarg;
+      break;
+    case 'O':
+      out_name = optarg;
+      break;
+    case 'C':
+      capture_name = optarg;
+      break;
+    case 'S':
+      control_name = optarg;
+      add_command("--control", 1);
+      add_command(absolute_path(optarg), 1);
+      break;
     case 'k':
       keydown_tracker = 1;
       add_command("-k", 1);
@@ -1709,6 +2919,10 @@ main(int argc, char **argv)
       auto_feedback = 0;
       add_command("-n", 1);
       break;
+    case 'u':
+      use_uinput = 1;
+      add_command("-u", 1);
+      break;
     case 'o':
       jack_num_outputs = 1;
       if (optarg && *optarg) {
@@ -1751,8 +2965,11 @@ main(int argc, char **argv)
 	  case 'j':
 	    debug_jack = 1;
 	    break;
+	  case 'l':
+	    debug_latency = 1;
+	    break;
 	  default:
-	    fprintf(stderr, "%s: unknown debugging option (-d), must be r, s, k or j\n", argv[0]);
+	    fprintf(stderr, "%s: unknown debugging option (-d), must be r, s, k, m, j or l\n", argv[0]);
 	    fprintf(stderr, "Try -h for help.\n");
 	    exit(1);
 	  }
@@ -1761,7 +2978,7 @@ main(int argc, char **argv)
       } else {
 	default_debug_regex = default_debug_strokes = default_debug_keys =
 	  default_debug_midi = 1;
-	debug_jack = 1;
+	debug_jack = debug_latency = 1;
 	add_command("-d", 1);
       }
       break;
@@ -1854,7 +3071,25 @@ main(int argc, char **argv)
 
   if (command_line) jack_command_line = command_line;
 
+  // In check mode we just load the config file and report on it, we don't
+  // need X or Jack for that.
+  if (check) exit(check_config());
+  // Likewise for replaying recorded MIDI input.
+  if (replay_name) exit(replay(replay_name, focus_name, out_name));
+
   initdisplay();
+  if (use_uinput && !init_uinput()) {
+    fprintf(stderr, "unable to create uinput device\n");
+    exit(1);
+  }
+  init_output();
+  init_trace();
+  start_time = time(0);
+  if (control_name && !init_control(control_name)) exit(1);
+
+  // Set up change notifications for the config file. If this isn't
+  // available, we fall back to checking the file once per second.
+  int watch_fd = init_config_watch();
 
   // Force the config file to be loaded initially, so that we pick up the Jack
   // client name and number of output ports (if not set from the command
@@ -1862,6 +3097,8 @@ main(int argc, char **argv)
   // the client name or number of ports take effect, you need to restart the
   // program.
   read_config_file();
+  // Subsequent reloads are done in the background.
+  int reload_fd = init_config_reload();
 
   seq.client_name = jack_client_name;
   seq.n_in = jack_num_outputs>1?jack_num_outputs:1;
@@ -1872,9 +3109,15 @@ main(int argc, char **argv)
   seq.in[1] = jack_num_outputs>1?jack_in_regex[1]:0;
   seq.out[0] = jack_num_outputs>0?jack_out_regex[0]:0;
   seq.out[1] = jack_num_outputs>1?jack_out_regex[1]:0;
+  seq.latency = record_latency;
+  if (capture_name) {
+    if (!init_capture(capture_name)) exit(1);
+    seq.capture = capture_midi;
+  }
   if (!init_jack(&seq, debug_jack)) {
     exit(1);
   }
+  start_capture(jack_get_sample_rate(seq.jack_client));
 
   passthrough[0] = jack_num_outputs>0?passthrough[0]>0:0;
   passthrough[1] = jack_num_outputs>1?passthrough[1]>0:0;
@@ -1892,36 +3135,106 @@ main(int argc, char **argv)
   int do_flush = debug_regex || debug_strokes || debug_keys || debug_midi ||
     debug_jack;
   signal(SIGINT, quitter);
-  time_t t0 = time(0);
+  signal(SIGUSR1, dumper);
+  time_t t0 = time(0), t1 = t0;
+  // We can't wait for MIDI input (which comes in through the Jack
+  // ringbuffers), so we still need to poll, but we also wake up immediately
+  // if there are any X events or changes to the config file.
+  struct pollfd pfd[3+MAX_CONTROL_CLIENTS+1];
+  int npfd = 0, xfd = -1, wfd = -1, rfd = -1;
+  if (display) {
+    pfd[npfd].fd = ConnectionNumber(display);
+    pfd[npfd].events = POLLIN;
+    xfd = npfd++;
+  }
+  if (watch_fd >= 0) {
+    pfd[npfd].fd = watch_fd;
+    pfd[npfd].events = POLLIN;
+    wfd = npfd++;
+  }
+  if (reload_fd >= 0) {
+    pfd[npfd].fd = reload_fd;
+    pfd[npfd].events = POLLIN;
+    rfd = npfd++;
+  }
   while (!quit) {
     uint8_t portno;
     if (jack_quit) {
+      close_trace();
       printf("[jack %s, exiting]\n",
 	     (jack_quit>0)?"asked us to quit":"shutting down");
       close_jack(&seq);
+      close_capture();
+      close_control();
+      close_output();
+      close_uinput();
+      if (debug_latency) print_latency_stats();
+      print_profile();
       exit(0);
     }
     process_connections(&seq);
-    while (pop_midi(&seq, msg, &portno)) {
+    focus_valid = 0;
+    while (1) {
+      PROF_BEGIN(prof_t);
+      int n = pop_midi(&seq, msg, &portno, &event_stamp, &event_frames);
+      PROF_END(PROF_POP, prof_t);
+      if (!n) break;
+      events_in[portno]++;
+      PROF_BEGIN(prof_t2);
       handle_event(msg, portno, 0, 0);
+      PROF_END(PROF_EVENT, prof_t2);
+      check_flush_keys();
+    }
+    // flush all key events of this batch
+    flush_keys();
+    flush_trace();
+    // the control socket's clients come and go, so these are added anew
+    int ncfd = control_pollfds(pfd+npfd);
+    if (poll(pfd, npfd+ncfd, POLL_INTERVAL/1000) <= 0) {
+      for (int i = 0; i < npfd+ncfd; i++) pfd[i].revents = 0;
+    }
+    process_control(pfd+npfd, ncfd);
+    // Xlib may already have read some events while waiting for a reply, so
+    // check its queue, too.
+    if (display && (XQLength(display) || (pfd[xfd].revents & POLLIN)))
+      process_xevents();
+    if (wfd >= 0) {
+      if ((pfd[wfd].revents & POLLIN) && check_config_watch())
+	reload_config_file();
+    } else {
       time_t t = time(0);
       if (t > t0) {
 	// Check whether to reload the config file every sec.
-	if (read_config_file()) last_focused_window = 0;
+	reload_config_file();
 	t0 = t;
       }
     }
-    usleep(POLL_INTERVAL);
-    time_t t = time(0);
-    if (t > t0) {
-      // Check again when polling.
-      if (read_config_file()) last_focused_window = 0;
-      t0 = t;
+    // install the new configuration once the background reload is done
+    if (rfd >= 0 && (pfd[rfd].revents & POLLIN))
+      finish_config_reload();
+    if (dump_latency) {
+      dump_latency = 0;
+      print_latency_stats();
     }
     // Make sure that debugging output gets flushed every once in a while (may
-    // be buffered when midizap is running inside a QjackCtl session).
-    if (do_flush) fflush(NULL);
+    // be buffered when midizap is running inside a QjackCtl session). The
+    // per-event messages are taken care of by the trace thread, so once per
+    // second is enough here.
+    if (do_flush) {
+      time_t t = time(0);
+      if (t != t1) {
+	fflush(NULL);
+	t1 = t;
+      }
+    }
   }
+  close_trace();
   printf(" [exiting]\n");
   close_jack(&seq);
+  close_capture();
+  close_control();
+  close_output();
+  close_uinput();
+  if (debug_latency) print_latency_stats();
+  print_profile();
 }
@@ -11,12 +11,20 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <pthread.h>
 
 #include <linux/input.h>
 
 #include <sys/time.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <poll.h>
 #include<signal.h>
 
 #include <regex.h>
@@ -48,6 +56,10 @@ typedef struct _stroke {
   struct _stroke *next;
   // nonzero keysym indicates a key event
   KeySym keysym;
+  // key code for the keysym, resolved when the config is loaded (and after
+  // a change of the keyboard mapping), so that we don't have to look it up
+  // each time the key is sent (X or evdev key code, depending on -u)
+  uint16_t keycode;
   int8_t press; // zero -> release, non-zero -> press
   // nonzero value indicates a shift event
   int8_t shift;
@@ -93,14 +105,35 @@ typedef struct _stroke_data {
   uint8_t anyshift;
 } stroke_data;
 
-#define N_SHIFTS 4 // number of distinct shift states
+#define N_SHIFTS 16 // number of distinct shift states
 #define N_ST (N_SHIFTS+1)
 
+// memory arena (see readconfig.c)
+typedef struct _arena_chunk arena_chunk;
+typedef struct _arena {
+  arena_chunk *chunks;
+  size_t size;
+} arena;
+
+// mapped cache file (see cache.c)
+typedef struct _config_image config_image;
+
 typedef struct _translation {
-  struct _translation *next;
   char *name;
   int mode, is_default;
+  // the regex, and its source (needed to recompile it, see cache.c)
   regex_t regex;
+  char *pattern;
+  // fingerprint of the source text of the section, so that unchanged
+  // sections can be reused on reload (0 if none)
+  uint64_t fingerprint;
+  // number of errors in this section
+  int errors;
+  // number of translation sets sharing this section
+  int refs;
+  // memory holding the section, or the cached image it lives in
+  arena mem;
+  config_image *image;
   uint8_t portno;
   // these are indexed by shift status
   stroke_data *note[N_ST];
@@ -123,9 +156,148 @@ typedef struct _translation {
     a_kp[N_ST], a_kps[N_ST], a_cp[N_ST], a_cps[N_ST];
 } translation;
 
+// A complete set of translations along with the settings from the config
+// file. On reload, a new set is built in the background and then swapped in
+// as a whole, replacing the previous one. Sections which didn't change are
+// shared with the previous set.
+typedef struct _translation_set {
+  translation **sections;
+  int n_sections, a_sections;
+  translation *default_translation, *default_midi_translation[2];
+  int debug_regex, debug_strokes, debug_keys, debug_midi;
+  int midi_octave, no_feedback;
+  // Jack settings (-1 or NULL if not set), these take effect at startup
+  char *jack_client_name, *jack_in_regex[2], *jack_out_regex[2];
+  int jack_num_outputs, passthrough[2], system_passthrough[2];
+  // number of errors found while parsing
+  int errors;
+  // memory holding the set (not including the sections), or the cached
+  // image it lives in
+  arena mem;
+  config_image *image;
+} translation_set;
+
+// time spent in the different phases of loading a configuration, in
+// milliseconds (see check.c)
+typedef struct {
+  double read, include, hash, cache, parse, regex, finish;
+  // whether there was a valid cache image
+  int cached;
+} config_timing;
+
 extern void reload_callback(void);
+extern void sync_trace(void);
+extern int lookup_keycode(KeySym sym);
+extern void refresh_keycodes(void);
 extern int read_config_file(void);
+extern int init_config_reload(void);
+extern int reload_config_file(void);
+extern int finish_config_reload(void);
+extern int init_config_watch(void);
+extern int check_config_watch(void);
 extern translation *get_translation(char *win_title, char *win_class);
+extern translation_set *get_translation_set(void);
+// the different kinds of stroke data in a section, in the order note, notes,
+// pc, cc, ccs, pb, pbs, kp, kps, cp, cps (see check.c)
+#define N_KINDS 11
+extern stroke_data *get_stroke_data(translation *tr, int kind, int k,
+				    uint16_t *n);
+extern translation_set *load_config_for_check(config_timing *t);
+extern int check_config(void);
+extern char *KeySym_to_string(KeySym ks);
+
+// Per-stage cycle counters (make PROFILE=1). PROF_BEGIN() starts timing a
+// stage, PROF_END() adds the elapsed time to the stage's counters. The
+// counters are plain (non-atomic) variables, so each stage must only ever be
+// timed in one thread: the output thread for PROF_OUTPUT and PROF_FLUSH,
+// the reload thread for PROF_RELOAD (or the main thread if it can't be
+// started), and the main thread for all others. Without PROFILE, these
+// expand to nothing. The counters are printed on exit (see midizap.c).
+#ifdef PROFILE
+enum { PROF_EVENT, PROF_POP, PROF_FOCUS, PROF_LOOKUP, PROF_SEND_MIDI,
+       PROF_QUEUE_MIDI, PROF_SEND_KEY, PROF_OUTPUT, PROF_FLUSH, PROF_RELOAD,
+       PROF_INSTALL, N_PROF };
+extern uint64_t prof_cycles[N_PROF], prof_calls[N_PROF];
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define PROF_UNIT "cycles"
+#define prof_clock() __rdtsc()
+#else
+#define PROF_UNIT "nsecs"
+static inline uint64_t prof_clock(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+#endif
+#define PROF_BEGIN(t) uint64_t t = prof_clock()
+#define PROF_END(stage, t) \
+  (prof_cycles[stage] += prof_clock() - (t), prof_calls[stage]++)
+extern void print_profile(void);
+#else
+#define PROF_BEGIN(t)
+#define PROF_END(stage, t)
+#define print_profile()
+#endif
+
+// Replay mode (see replay.c).
+extern int replaying;
+extern int replay(char *name, char *focus_name, char *out_name);
+extern void replay_midi(uint8_t *msg, uint8_t portno);
+extern void replay_key(KeySym key, int press);
+extern void set_replay_focus(char *win_class, char *win_title);
+extern void handle_event(uint8_t *msg, uint8_t portno, int depth,
+			 int recursive);
+
+// Capture files, as written by --capture and read by --replay. The file starts with a header giving
+// the Jack sample rate, followed by a sequence of records, each consisting
+// of a record header and len bytes of payload. Timestamps are in Jack
+// frames. MIDI records carry a single MIDI message as received (this may
+// also be a system message), focus records the class and title of the newly
+// focused window, each terminated with a zero byte. All numbers are in host
+// byte order.
+#define CAPTURE_MAGIC "MZC1"
+
+typedef struct {
+  char magic[4];
+  uint32_t rate;
+} capture_header;
+
+typedef struct {
+  uint32_t frames;
+  uint8_t type, port;
+  uint16_t len;
+} capture_record;
+
+#define CAPTURE_MIDI 0
+#define CAPTURE_FOCUS 1
+
+// Capturing input (see capture.c).
+extern int init_capture(char *name);
+extern void start_capture(uint32_t rate);
+extern void close_capture(void);
+extern void capture_midi(uint8_t port_no, uint32_t frames, uint8_t *msg,
+			 size_t len);
+extern void capture_focus(uint32_t frames, char *win_class, char *win_title);
+
+// The control socket (see control.c).
+#define MAX_CONTROL_CLIENTS 8
+extern int init_control(char *name);
+extern int control_pollfds(struct pollfd *pfd);
+extern void process_control(struct pollfd *pfd, int n);
+extern void close_control(void);
+extern void print_stats(FILE *fp);
+extern void print_values(FILE *fp);
+extern void print_rule_stats(FILE *fp);
+extern unsigned long config_loads, config_rejects;
+extern unsigned long config_cache_hits, config_cache_misses;
+extern uint64_t hash_bytes(const void *p, size_t n);
+extern translation_set *load_config_cache(char *name, size_t len,
+					  uint64_t hash);
+extern void release_config_image(config_image *img);
+extern void save_config_cache(char *name, size_t len, uint64_t hash,
+			      translation_set *ts);
 extern void print_stroke_sequence(char *name, char *up_or_down, stroke *s,
 				  int mod, int step, int n_steps, int *steps,
 				  int val);
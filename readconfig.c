@@ -96,120 +96,185 @@ alloc_strcat(char *a, char *b)
   return result;
 }
 
-static char *read_line_buffer = NULL;
-static int read_line_buffer_length = 0;
+// The translation set which is currently being built by the parser. This is
+// thread-local, since parsing is done in a background thread on reload,
+// while the main thread keeps using the installed translations.
+static __thread translation_set *cur_set = NULL;
+// The section being parsed, and the arena the parser allocates from (the
+// section's, or the set's outside of a section).
+static __thread translation *cur_section = NULL;
+static __thread arena *cur_arena = NULL;
+
+// Report an error in the configuration. These are counted, so that we can
+// refuse to install a broken configuration on reload.
+static void
+config_error(const char *fmt, ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+  if (cur_set) cur_set->errors++;
+  if (cur_section) cur_section->errors++;
+}
 
-#define BUF_GROWTH_STEP 1024
+// Memory arenas. All memory belonging to a translation section (stroke
+// data, strokes, step tables) comes from the section's arena, so that the
+// section can be released in one go when it isn't needed any more. The set
+// has an arena of its own for the rest. Memory is handed out from a list of
+// chunks, which only get freed along with the arena.
 
+#define ARENA_CHUNK_SIZE 65536
 
-// read a line of text from the given file into a managed buffer.
-// returns a partial line at EOF if the file does not end with \n.
-// exits with error message on read error.
-char *
-read_line(FILE *f, char *name)
+struct _arena_chunk {
+  struct _arena_chunk *next;
+  size_t size, used;
+  // the data follows, suitably aligned
+  max_align_t data[];
+};
+
+static void *
+arena_alloc(arena *a, size_t len)
 {
-  int pos = 0;
-  char *new_buffer;
-  int new_buffer_length;
+  arena_chunk *c = a->chunks;
+  void *ret;
+
+  // keep everything aligned
+  len = (len + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+  if (!c || c->size - c->used < len) {
+    // start a new chunk (big requests get a chunk of their own)
+    size_t size = len > ARENA_CHUNK_SIZE ? len : ARENA_CHUNK_SIZE;
+    c = (arena_chunk *)allocate(sizeof(arena_chunk) + size);
+    c->size = size;
+    c->used = 0;
+    c->next = a->chunks;
+    a->chunks = c;
+    a->size += size;
+  }
+  ret = (char*)c->data + c->used;
+  c->used += len;
+  // chunks are allocated with calloc and never reused, so this is zeroed
+  return ret;
+}
 
-  if (read_line_buffer == NULL) {
-    read_line_buffer_length = BUF_GROWTH_STEP;
-    read_line_buffer = allocate(read_line_buffer_length);
-    read_line_buffer[0] = '\0';
-  }
+// Grow a block previously obtained with arena_alloc(). The old block isn't
+// reused; it gets released along with the rest of the arena.
+static void *
+arena_realloc(arena *a, void *p, size_t oldlen, size_t len)
+{
+  void *ret = arena_alloc(a, len);
+  if (p) memcpy(ret, p, oldlen < len ? oldlen : len);
+  return ret;
+}
 
-  while (1) {
-    read_line_buffer[read_line_buffer_length-1] = '\377';
-    if (fgets(read_line_buffer+pos, read_line_buffer_length-pos, f) == NULL) {
-      if (feof(f)) {
-	if (pos > 0) {
-	  // partial line at EOF
-	  return read_line_buffer;
-	} else {
-	  return NULL;
-	}
-      }
-      perror(name);
-      exit(1);
-    }
-    if (read_line_buffer[read_line_buffer_length-1] != '\0') {
-      return read_line_buffer;
-    }
-    if (read_line_buffer[read_line_buffer_length-2] == '\n') {
-      return read_line_buffer;
-    }
-    new_buffer_length = read_line_buffer_length + BUF_GROWTH_STEP;
-    new_buffer = allocate(new_buffer_length);
-    memcpy(new_buffer, read_line_buffer, read_line_buffer_length);
-    free(read_line_buffer);
-    pos = read_line_buffer_length-1;
-    read_line_buffer = new_buffer;
-    read_line_buffer_length = new_buffer_length;
-  }
+static char *
+arena_strdup(arena *a, char *s)
+{
+  char *ret = arena_alloc(a, strlen(s)+1);
+  strcpy(ret, s);
+  return ret;
+}
+
+static void
+free_arena(arena *a)
+{
+  arena_chunk *c = a->chunks, *next;
+  while (c) {
+    next = c->next;
+    free(c);
+    c = next;
+  }
+  a->chunks = NULL;
+  a->size = 0;
 }
 
-static translation *first_translation_section = NULL;
-static translation *last_translation_section = NULL;
+// the currently installed translations
+static translation_set *current_set = NULL;
+
+// Some statistics about configuration loads, for the control socket. The
+// cache counters are updated from the reload thread.
+unsigned long config_loads = 0, config_rejects = 0;
+unsigned long config_cache_hits = 0, config_cache_misses = 0;
+
+// If set, the time spent in some phases of parsing is recorded here. This
+// is only used when checking a config file (see check.c).
+static config_timing *timing = NULL;
+
+static double
+get_msecs(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1e3 + ts.tv_nsec/1e6;
+}
 translation *default_translation, *default_midi_translation[2];
 
+// Add a section to the given set.
+static void
+add_translation_section(translation_set *ts, translation *tr)
+{
+  if (ts->n_sections >= ts->a_sections) {
+    int a0 = ts->a_sections;
+    ts->a_sections = a0?2*a0:16;
+    ts->sections = arena_realloc(&ts->mem, ts->sections,
+				 a0*sizeof(translation*),
+				 ts->a_sections*sizeof(translation*));
+  }
+  ts->sections[ts->n_sections++] = tr;
+  if (tr->is_default) {
+    if (!strcmp(tr->name, "MIDI"))
+      ts->default_midi_translation[0] = tr;
+    else if (!strcmp(tr->name, "MIDI2"))
+      ts->default_midi_translation[1] = tr;
+    else
+      ts->default_translation = tr;
+  }
+}
+
+static void free_translation_section(translation *tr);
+
 translation *
 new_translation_section(char *name, int mode, char *regex)
 {
   translation *ret = (translation *)allocate(sizeof(translation));
   int err;
 
-  memset(ret, 0, sizeof(translation));
-  if (debug_strokes) {
+  if (cur_set->debug_strokes) {
     printf("------------------------\n[%s] %s%s\n\n", name,
 	   mode==1?"TITLE ":mode==2?"CLASS ":"",
 	   regex);
   }
-  ret->next = NULL;
-  ret->name = alloc_strcat(name, NULL);
+  memset(ret, 0, sizeof(translation));
+  ret->refs = 1;
+  cur_section = ret;
+  cur_arena = &ret->mem;
+  ret->name = arena_strdup(cur_arena, name);
   ret->mode = mode;
   if (regex == NULL || *regex == '\0') {
     ret->is_default = 1;
-    if (!strcmp(name, "MIDI"))
-      default_midi_translation[0] = ret;
-    else if (!strcmp(name, "MIDI2")) {
-      default_midi_translation[1] = ret;
+    if (!strcmp(name, "MIDI2"))
       ret->portno = 1;
-    } else
-      default_translation = ret;
   } else {
     ret->is_default = 0;
+    ret->pattern = arena_strdup(cur_arena, regex);
+    double t0 = timing ? get_msecs() : 0;
     err = regcomp(&ret->regex, regex, REG_EXTENDED|REG_NOSUB);
+    if (timing) timing->regex += get_msecs() - t0;
     if (err != 0) {
-      regerror(err, &ret->regex, read_line_buffer, read_line_buffer_length);
-      fprintf(stderr, "error compiling regex for [%s]: %s\n", name, read_line_buffer);
-      regfree(&ret->regex);
-      free(ret->name);
-      free(ret);
+      char msg[256];
+      regerror(err, &ret->regex, msg, sizeof(msg));
+      config_error("error compiling regex for [%s]: %s\n", ret->name, msg);
+      ret->is_default = 1; // no regex to free
+      free_translation_section(ret);
+      cur_section = NULL;
+      cur_arena = &cur_set->mem;
       return NULL;
     }
   }
-  if (first_translation_section == NULL) {
-    first_translation_section = ret;
-    last_translation_section = ret;
-  } else {
-    last_translation_section->next = ret;
-    last_translation_section = ret;
-  }
+  add_translation_section(cur_set, ret);
   return ret;
 }
 
-void
-free_strokes(stroke *s)
-{
-  stroke *next;
-  while (s != NULL) {
-    next = s->next;
-    if (s->steps) free(s->steps);
-    free(s);
-    s = next;
-  }
-}
-
 static int stroke_data_cmp(const void *a, const void *b)
 {
   const stroke_data *ad = (const stroke_data*)a;
@@ -220,35 +285,16 @@ static int stroke_data_cmp(const void *a, const void *b)
     return ad->chan - bd->chan;
 }
 
-static void finish_stroke_data(stroke_data **sd,
-			       uint16_t *n, uint16_t *a)
+static void finish_stroke_data(stroke_data **sd, uint16_t *n)
 {
-  if (*a && *a > *n) {
-    // realloc to needed size
-    *sd = realloc(*sd, (*n)*sizeof(stroke_data));
-    *a = *n;
-  }
   // sort by chan/data for faster access
   qsort(*sd, *n, sizeof(stroke_data), stroke_data_cmp);
 }
 
-static void free_stroke_data(stroke_data *sd, uint16_t n)
-{
-  uint16_t i;
-  for (i = 0; i < n; i++) {
-    free_strokes(sd[i].s[0]);
-    free_strokes(sd[i].s[1]);
-    if (sd[i].steps[0]) free(sd[i].steps[0]);
-    if (sd[i].steps[1]) free(sd[i].steps[1]);
-  }
-  free(sd);
-}
-
-
 static int *stepsdup(int n_steps, int *steps)
 {
   if (n_steps) {
-    int *ret = malloc(n_steps*sizeof(int));
+    int *ret = arena_alloc(cur_arena, n_steps*sizeof(int));
     memcpy(ret, steps, n_steps*sizeof(int));
     return ret;
   } else
@@ -278,8 +324,9 @@ static stroke **find_stroke_data(stroke_data **sd,
   // add a new entry
   if (*n >= *a) {
     // make some room
+    uint16_t a0 = *a;
     *a = (*a)?2*(*a):8;
-    *sd = realloc(*sd, (*a)*sizeof(stroke_data));
+    *sd = arena_realloc(cur_arena, *sd, a0*sizeof(stroke_data), (*a)*sizeof(stroke_data));
   }
   memset(&(*sd)[*n], 0, sizeof(stroke_data));
   (*sd)[*n].chan = chan;
@@ -439,119 +486,490 @@ static stroke **find_pbs(translation *tr, int shift,
 			    &tr->n_pbs[shift], &tr->a_pbs[shift]);
 }
 
-static void dup_stroke_data(stroke_data **sd, uint16_t *n, uint16_t *a,
-			    stroke_data *sd0, uint16_t n0,
-			    stroke_data *sd1, uint16_t n1);
-
 void
 finish_translation_section(translation *tr)
 {
   int k;
+  double t0;
 
   if (tr) {
-    for (k=1; k<N_SHIFTS+1; k++) {
-      dup_stroke_data(&tr->pc[k], &tr->n_pc[k], &tr->a_pc[k],
-		      0, 0,
-		      tr->pc[0], tr->n_pc[0]);
-      dup_stroke_data(&tr->note[k], &tr->n_note[k], &tr->a_note[k],
-		      tr->notes[k], tr->n_notes[k],
-		      tr->note[0], tr->n_note[0]);
-      dup_stroke_data(&tr->notes[k], &tr->n_notes[k], &tr->a_notes[k],
-		      tr->note[k], tr->n_note[k],
-		      tr->notes[0], tr->n_notes[0]);
-      dup_stroke_data(&tr->cc[k], &tr->n_cc[k], &tr->a_cc[k],
-		      tr->ccs[k], tr->n_ccs[k],
-		      tr->cc[0], tr->n_cc[0]);
-      dup_stroke_data(&tr->ccs[k], &tr->n_ccs[k], &tr->a_ccs[k],
-		      tr->cc[k], tr->n_cc[k],
-		      tr->ccs[0], tr->n_ccs[0]);
-      dup_stroke_data(&tr->pb[k], &tr->n_pb[k], &tr->a_pb[k],
-		      tr->pbs[k], tr->n_pbs[k],
-		      tr->pb[0], tr->n_pb[0]);
-      dup_stroke_data(&tr->pbs[k], &tr->n_pbs[k], &tr->a_pbs[k],
-		      tr->pb[k], tr->n_pb[k],
-		      tr->pbs[0], tr->n_pbs[0]);
-      dup_stroke_data(&tr->kp[k], &tr->n_kp[k], &tr->a_kp[k],
-		      tr->kps[k], tr->n_kps[k],
-		      tr->kp[0], tr->n_kp[0]);
-      dup_stroke_data(&tr->kps[k], &tr->n_kps[k], &tr->a_kps[k],
-		      tr->kp[k], tr->n_kp[k],
-		      tr->kps[0], tr->n_kps[0]);
-      dup_stroke_data(&tr->cp[k], &tr->n_cp[k], &tr->a_cp[k],
-		      tr->cps[k], tr->n_cps[k],
-		      tr->cp[0], tr->n_cp[0]);
-      dup_stroke_data(&tr->cps[k], &tr->n_cps[k], &tr->a_cps[k],
-		      tr->cp[k], tr->n_cp[k],
-		      tr->cps[0], tr->n_cps[0]);
-    }
+    t0 = timing ? get_msecs() : 0;
     for (k=0; k<N_SHIFTS+1; k++) {
-      finish_stroke_data(&tr->pc[k], &tr->n_pc[k], &tr->a_pc[k]);
-      finish_stroke_data(&tr->note[k], &tr->n_note[k], &tr->a_note[k]);
-      finish_stroke_data(&tr->notes[k], &tr->n_notes[k], &tr->a_notes[k]);
-      finish_stroke_data(&tr->cc[k], &tr->n_cc[k], &tr->a_cc[k]);
-      finish_stroke_data(&tr->ccs[k], &tr->n_ccs[k], &tr->a_ccs[k]);
-      finish_stroke_data(&tr->pb[k], &tr->n_pb[k], &tr->a_pb[k]);
-      finish_stroke_data(&tr->pbs[k], &tr->n_pbs[k], &tr->a_pbs[k]);
-      finish_stroke_data(&tr->kp[k], &tr->n_kp[k], &tr->a_kp[k]);
-      finish_stroke_data(&tr->kps[k], &tr->n_kps[k], &tr->a_kps[k]);
-      finish_stroke_data(&tr->cp[k], &tr->n_cp[k], &tr->a_cp[k]);
-      finish_stroke_data(&tr->cps[k], &tr->n_cps[k], &tr->a_cps[k]);
+      finish_stroke_data(&tr->pc[k], &tr->n_pc[k]);
+      finish_stroke_data(&tr->note[k], &tr->n_note[k]);
+      finish_stroke_data(&tr->notes[k], &tr->n_notes[k]);
+      finish_stroke_data(&tr->cc[k], &tr->n_cc[k]);
+      finish_stroke_data(&tr->ccs[k], &tr->n_ccs[k]);
+      finish_stroke_data(&tr->pb[k], &tr->n_pb[k]);
+      finish_stroke_data(&tr->pbs[k], &tr->n_pbs[k]);
+      finish_stroke_data(&tr->kp[k], &tr->n_kp[k]);
+      finish_stroke_data(&tr->kps[k], &tr->n_kps[k]);
+      finish_stroke_data(&tr->cp[k], &tr->n_cp[k]);
+      finish_stroke_data(&tr->cps[k], &tr->n_cps[k]);
     }
+    if (timing) timing->finish += get_msecs() - t0;
   }
 }
 
-void
+// Drop a reference to a section, freeing it when it's no longer used by
+// any translation set.
+static void
 free_translation_section(translation *tr)
 {
-  int k;
+  if (--tr->refs > 0) return;
+  // The compiled regex is the only thing not in the arena.
+  if (!tr->is_default) {
+    regfree(&tr->regex);
+  }
+  if (tr->image) {
+    // loaded from the cache, the section lives in the mapped image
+    release_config_image(tr->image);
+    return;
+  }
+  free_arena(&tr->mem);
+  free(tr);
+}
 
-  if (tr != NULL) {
-    free(tr->name);
-    if (!tr->is_default) {
-      regfree(&tr->regex);
+static void
+free_translation_set(translation_set *ts)
+{
+  int i;
+
+  if (ts == NULL) return;
+  for (i = 0; i < ts->n_sections; i++) {
+    free_translation_section(ts->sections[i]);
+  }
+  if (ts->image) {
+    release_config_image(ts->image);
+    return;
+  }
+  free_arena(&ts->mem);
+  free(ts);
+}
+
+// Look for a section with the given fingerprint in the given set.
+static translation *
+find_translation_section(translation_set *ts, uint64_t fingerprint)
+{
+  int i;
+
+  if (!ts || !fingerprint) return NULL;
+  for (i = 0; i < ts->n_sections; i++) {
+    if (ts->sections[i]->fingerprint == fingerprint)
+      return ts->sections[i];
+  }
+  return NULL;
+}
+
+// Compute the fingerprints of all sections in the given config text, i.e.,
+// the hashes of their source text, from the section header up to the next
+// header (or the end of the file). Returns the number of sections.
+static int
+section_fingerprints(char *text, size_t len, uint64_t **fingerprints)
+{
+  char *p = text, *end = text+len, *start = NULL;
+  int n = 0, a = 0;
+
+  *fingerprints = NULL;
+  while (p < end) {
+    char *next = memchr(p, '\n', end-p), *q = p;
+    next = next ? next+1 : end;
+    while (q < next && isspace(*q)) q++;
+    if (q < next && *q == '[') {
+      if (start) {
+	if (n >= a) {
+	  a = a?2*a:16;
+	  *fingerprints = realloc(*fingerprints, a*sizeof(uint64_t));
+	  if (!*fingerprints) return 0;
+	}
+	(*fingerprints)[n++] = hash_bytes(start, p-start);
+      }
+      start = p;
     }
-    for (k=0; k<N_SHIFTS+1; k++) {
-      free_stroke_data(tr->pc[k], tr->n_pc[k]);
-      free_stroke_data(tr->note[k], tr->n_note[k]);
-      free_stroke_data(tr->cc[k], tr->n_cc[k]);
-      free_stroke_data(tr->ccs[k], tr->n_ccs[k]);
-      free_stroke_data(tr->pb[k], tr->n_pb[k]);
-      free_stroke_data(tr->pbs[k], tr->n_pbs[k]);
+    p = next;
+  }
+  if (start) {
+    if (n >= a) {
+      *fingerprints = realloc(*fingerprints, (n+1)*sizeof(uint64_t));
+      if (!*fingerprints) return 0;
     }
-    free(tr);
+    (*fingerprints)[n++] = hash_bytes(start, end-start);
   }
+  return n;
+}
+
+static void refresh_stroke_data(stroke_data *sd, uint16_t n)
+{
+  uint16_t i;
+  int index;
+  stroke *s;
+  for (i = 0; i < n; i++)
+    for (index = 0; index < 2; index++)
+      for (s = sd[i].s[index]; s; s = s->next)
+	if (s->keysym) s->keycode = lookup_keycode(s->keysym);
 }
 
+// Resolve the key codes of all keysyms in the loaded configuration again.
+// This needs to be done whenever the keyboard mapping changes.
 void
-free_all_translations(void)
+refresh_keycodes(void)
 {
-  translation *tr = first_translation_section;
-  translation *next;
+  translation *tr;
+  int i, k;
 
-  while (tr != NULL) {
-    next = tr->next;
-    free_translation_section(tr);
-    tr = next;
+  if (!current_set) return;
+  for (i = 0; i < current_set->n_sections; i++) {
+    tr = current_set->sections[i];
+    for (k=0; k<N_SHIFTS+1; k++) {
+      refresh_stroke_data(tr->pc[k], tr->n_pc[k]);
+      refresh_stroke_data(tr->note[k], tr->n_note[k]);
+      refresh_stroke_data(tr->notes[k], tr->n_notes[k]);
+      refresh_stroke_data(tr->cc[k], tr->n_cc[k]);
+      refresh_stroke_data(tr->ccs[k], tr->n_ccs[k]);
+      refresh_stroke_data(tr->pb[k], tr->n_pb[k]);
+      refresh_stroke_data(tr->pbs[k], tr->n_pbs[k]);
+      refresh_stroke_data(tr->kp[k], tr->n_kp[k]);
+      refresh_stroke_data(tr->kps[k], tr->n_kps[k]);
+      refresh_stroke_data(tr->cp[k], tr->n_cp[k]);
+      refresh_stroke_data(tr->cps[k], tr->n_cps[k]);
+    }
   }
-  first_translation_section = NULL;
-  last_translation_section = NULL;
-  default_translation = default_midi_translation[0] =
-    default_midi_translation[1] = NULL;
 }
 
 char *config_file_name = NULL;
 static time_t config_file_modification_time;
 
+// Change notification for the configuration file. We watch the directory of
+// the file, so that we also catch editors which save by renaming a new file
+// over the old one, as well as the file being created, and the file itself,
+// so that changes to the target of a symbolic link get noticed, too. The
+// main loop waits on the inotify descriptor and calls check_config_watch()
+// when there are any events, so that we don't need to poll the file.
+
+static int watch_fd = -1, dir_wd = -1, file_wd = -1;
+static char *watch_name = NULL, *watch_base = NULL;
+
+int
+init_config_watch(void)
+{
+  watch_fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+  if (watch_fd < 0) {
+    perror("inotify_init1");
+  }
+  return watch_fd;
+}
+
+static void
+update_config_watch(void)
+{
+  if (watch_fd < 0) return;
+  if (!watch_name || strcmp(watch_name, config_file_name)) {
+    // (re)initialize the directory watch
+    char *dir, *s;
+    if (dir_wd >= 0) inotify_rm_watch(watch_fd, dir_wd);
+    if (file_wd >= 0) inotify_rm_watch(watch_fd, file_wd);
+    dir_wd = file_wd = -1;
+    if (watch_name) free(watch_name);
+    watch_name = alloc_strcat(config_file_name, NULL);
+    s = strrchr(watch_name, '/');
+    if (s) {
+      watch_base = s+1;
+      dir = alloc_strcat(watch_name, NULL);
+      dir[s>watch_name?s-watch_name:1] = 0;
+    } else {
+      watch_base = watch_name;
+      dir = alloc_strcat(".", NULL);
+    }
+    dir_wd = inotify_add_watch(watch_fd, dir,
+			       IN_CLOSE_WRITE|IN_MOVED_TO|IN_ATTRIB);
+    if (dir_wd < 0) perror(dir);
+    free(dir);
+  }
+  // The file may have been replaced since we last looked at it, so we need
+  // to renew this watch after each reload. This may fail if the file doesn't
+  // exist (yet), in which case we rely on the directory watch.
+  int wd = inotify_add_watch(watch_fd, watch_name, IN_CLOSE_WRITE|IN_ATTRIB);
+  if (file_wd >= 0 && file_wd != wd) inotify_rm_watch(watch_fd, file_wd);
+  file_wd = wd;
+}
+
+// Read all pending events from the inotify descriptor, returns nonzero if
+// the configuration file changed and needs to be reloaded.
+int
+check_config_watch(void)
+{
+  char buf[4096]
+    __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  const struct inotify_event *ev;
+  ssize_t len;
+  char *p;
+  int changed = 0;
+
+  if (watch_fd < 0) return 0;
+  while ((len = read(watch_fd, buf, sizeof(buf))) > 0) {
+    for (p = buf; p < buf+len; p += sizeof(struct inotify_event)+ev->len) {
+      ev = (const struct inotify_event*)p;
+      if (ev->mask & IN_IGNORED) continue;
+      // events on the directory are only of interest if they concern our file
+      if (ev->wd != dir_wd || (ev->len && !strcmp(ev->name, watch_base)))
+	changed = 1;
+    }
+  }
+  // Make sure that the file gets reloaded, even if the modification time
+  // didn't change (it only has a resolution of one second).
+  if (changed) config_file_modification_time = 0;
+  return changed;
+}
+
+// Included files. The INCLUDE directive is expanded textually before the
+// config file is parsed, so that the rest of the loader (section
+// fingerprints, cache) sees the complete text. The contents of included
+// files are kept, keyed by their path and modification time, so that files
+// which didn't change don't have to be read again on reload; since their
+// sections then have the same text as before, they don't get parsed again
+// either. This list is only accessed by the loader, which runs either in the
+// main thread or in the reload thread, never in both at the same time.
+
+#define MAX_INCLUDE_DEPTH 16
+
+typedef struct _include_file {
+  struct _include_file *next;
+  char *name;
+  // identity of the file, to check whether it changed
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+  char *text;
+  size_t len;
+  // inotify watch, and whether the file was used in the last load
+  int wd, used;
+} include_file;
+
+static include_file *include_files = NULL;
+
+static int
+include_file_changed(include_file *inc, struct stat *st)
+{
+  return inc->dev != st->st_dev || inc->ino != st->st_ino ||
+    inc->size != st->st_size ||
+    inc->mtime.tv_sec != st->st_mtim.tv_sec ||
+    inc->mtime.tv_nsec != st->st_mtim.tv_nsec;
+}
+
+// Check whether any of the files included by the last load changed.
+static int
+includes_changed(void)
+{
+  include_file *inc;
+  struct stat st;
+
+  for (inc = include_files; inc; inc = inc->next) {
+    if (stat(inc->name, &st) < 0 || include_file_changed(inc, &st))
+      return 1;
+  }
+  return 0;
+}
+
+// Get the contents of an included file, reading it if necessary.
+static include_file *
+get_include_file(char *name)
+{
+  include_file *inc;
+  struct stat st;
+  FILE *f;
+
+  if (stat(name, &st) < 0) {
+    perror(name);
+    return NULL;
+  }
+  for (inc = include_files; inc; inc = inc->next) {
+    if (!strcmp(inc->name, name)) break;
+  }
+  // A file is only read once per load, so that its contents stay put while
+  // we're expanding it.
+  if (inc && !inc->used && include_file_changed(inc, &st)) {
+    free(inc->text);
+    inc->text = NULL;
+  }
+  if (!inc) {
+    inc = (include_file *)allocate(sizeof(include_file));
+    inc->name = alloc_strcat(name, NULL);
+    inc->wd = -1;
+    inc->next = include_files;
+    include_files = inc;
+  }
+  if (!inc->text) {
+    f = fopen(name, "r");
+    if (!f) {
+      perror(name);
+      return NULL;
+    }
+    inc->text = allocate(st.st_size+1);
+    inc->len = fread(inc->text, 1, st.st_size, f);
+    fclose(f);
+    inc->dev = st.st_dev;
+    inc->ino = st.st_ino;
+    inc->size = st.st_size;
+    inc->mtime = st.st_mtim;
+  }
+  // like the config file itself, the file may have been replaced, so we
+  // renew the watch each time
+  if (watch_fd >= 0) {
+    int wd = inotify_add_watch(watch_fd, name, IN_CLOSE_WRITE|IN_ATTRIB);
+    if (inc->wd >= 0 && inc->wd != wd) inotify_rm_watch(watch_fd, inc->wd);
+    inc->wd = wd;
+  }
+  inc->used = 1;
+  return inc;
+}
+
+typedef struct {
+  char *data;
+  size_t len, alloc;
+} text_buffer;
+
+static void
+append_text(text_buffer *buf, const char *s, size_t len)
+{
+  if (buf->len + len > buf->alloc) {
+    while (buf->len + len > buf->alloc)
+      buf->alloc = buf->alloc ? 2*buf->alloc : 4096;
+    buf->data = realloc(buf->data, buf->alloc);
+    if (!buf->data) {
+      fprintf(stderr, "Out of memory\n");
+      exit(1);
+    }
+  }
+  memcpy(buf->data + buf->len, s, len);
+  buf->len += len;
+}
+
+// Copy the given text to buf, replacing INCLUDE lines with the contents of
+// the included files. Returns the number of errors. Relative file names
+// are taken relative to the directory of the including file.
+static int
+expand_includes(char *name, char *text, size_t len, text_buffer *buf,
+		int depth)
+{
+  char *p = text, *end = text+len;
+  int errors = 0;
+
+  while (p < end) {
+    char *next = memchr(p, '\n', end-p), *q = p, *r, *path;
+    next = next ? next+1 : end;
+    while (q < next && isspace(*q)) q++;
+    if (next-q < 8 || strncmp(q, "INCLUDE", 7) || !isspace(q[7])) {
+      append_text(buf, p, next-p);
+      p = next;
+      continue;
+    }
+    // INCLUDE "file" or INCLUDE file
+    q += 8;
+    while (q < next && isspace(*q)) q++;
+    if (q < next && *q == '"') {
+      r = ++q;
+      while (r < next && *r != '"' && *r != '\n') r++;
+    } else {
+      r = q;
+      while (r < next && !isspace(*r)) r++;
+    }
+    if (r == q) {
+      fprintf(stderr, "%s: missing file name in INCLUDE\n", name);
+      errors++;
+      p = next;
+      continue;
+    }
+    path = allocate(strlen(name) + (r-q) + 2);
+    if (*q != '/' && strrchr(name, '/')) {
+      size_t n = strrchr(name, '/') - name + 1;
+      memcpy(path, name, n);
+      memcpy(path+n, q, r-q);
+      path[n+(r-q)] = 0;
+    } else {
+      memcpy(path, q, r-q);
+      path[r-q] = 0;
+    }
+    if (depth >= MAX_INCLUDE_DEPTH) {
+      fprintf(stderr, "%s: INCLUDE nested too deeply (recursive include?)\n",
+	      path);
+      errors++;
+    } else {
+      include_file *inc = get_include_file(path);
+      if (inc) {
+	errors += expand_includes(inc->name, inc->text, inc->len, buf,
+				  depth+1);
+	if (inc->len && inc->text[inc->len-1] != '\n')
+	  append_text(buf, "\n", 1);
+      } else {
+	errors++;
+      }
+    }
+    free(path);
+    p = next;
+  }
+  return errors;
+}
+
+// Check whether the text contains any INCLUDE lines at all.
+static int
+has_includes(char *text, size_t len)
+{
+  char *p = text, *end = text+len;
+
+  while (p < end) {
+    while (p < end && isspace(*p)) p++;
+    if (end-p >= 7 && !strncmp(p, "INCLUDE", 7)) return 1;
+    p = memchr(p, '\n', end-p);
+    if (!p) break;
+  }
+  return 0;
+}
+
+// Expand all includes in the config text. If there are any, the expanded
+// text goes to buf, with room for a terminating null byte; otherwise buf is
+// left empty. Files which aren't included any more are dropped.
+static int
+expand_config_includes(char *text, size_t len, text_buffer *buf)
+{
+  include_file *inc, **prev;
+  int errors = 0;
+
+  for (inc = include_files; inc; inc = inc->next)
+    inc->used = 0;
+  if (has_includes(text, len)) {
+    errors = expand_includes(config_file_name, text, len, buf, 0);
+    append_text(buf, "", 1);
+    buf->len--;
+  }
+  for (prev = &include_files; (inc = *prev); ) {
+    if (inc->used) {
+      prev = &inc->next;
+      continue;
+    }
+    *prev = inc->next;
+    if (watch_fd >= 0 && inc->wd >= 0) inotify_rm_watch(watch_fd, inc->wd);
+    free(inc->name);
+    free(inc->text);
+    free(inc);
+  }
+  return errors;
+}
+
 static char *token_src = NULL;
 
+// the delimiter set of token(), as a lookup table
+static const char token_delims[256] = {
+  [' '] = 1, ['\t'] = 1, ['\n'] = 1, ['/'] = 1, ['"'] = 1,
+};
+
 // similar to strtok, but it tells us what delimiter was found at the
 // end of the token, handles double quoted strings specially, and
 // hardcodes the delimiter set.
 char *
 token(char *src, char *delim_found)
 {
-  char *delims = " \t\n/\"";
-  char *d;
+  char d;
   char *token_start;
 
   if (src == NULL) {
@@ -563,15 +981,12 @@ token(char *src, char *delim_found)
   }
   token_start = src;
   while (*src) {
-    d = delims;
-    while (*d && *src != *d) {
-      d++;
-    }
-    if (*d) {
+    if (token_delims[(unsigned char)*src]) {
+      d = *src;
       if (src == token_start) {
 	src++;
 	token_start = src;
-	if (*d == '"') {
+	if (d == '"') {
 	  while (*src && *src != '"' && *src != '\n') {
 	    src++;
 	  }
@@ -579,7 +994,7 @@ token(char *src, char *delim_found)
 	  continue;
 	}
       }
-      *delim_found = *d;
+      *delim_found = d;
       if (*src) {
 	*src = '\0';
 	token_src = src+1;
@@ -613,32 +1028,74 @@ static keysymmapping key_sym_mapping[] = {
   { NULL, 0 }
 };
 
+// Indices into key_sym_mapping, sorted by name and by value, so that we
+// can look up keysyms using binary search instead of scanning the table
+// (which has a few thousand entries). These are built on the first call of
+// read_config_file(), before any parsing gets done in the background.
+#define N_KEYSYMS (sizeof(key_sym_mapping)/sizeof(keysymmapping)-1)
+static keysymmapping *keysyms_by_name[N_KEYSYMS];
+static keysymmapping *keysyms_by_value[N_KEYSYMS];
+static size_t n_keysyms_by_value = 0;
+
+static int keysym_name_cmp(const void *a, const void *b)
+{
+  const keysymmapping *ak = *(const keysymmapping**)a;
+  const keysymmapping *bk = *(const keysymmapping**)b;
+  return strcmp(ak->str, bk->str);
+}
+
+static int keysym_value_cmp(const void *a, const void *b)
+{
+  const keysymmapping *ak = *(const keysymmapping**)a;
+  const keysymmapping *bk = *(const keysymmapping**)b;
+  if (ak->sym != bk->sym)
+    return ak->sym < bk->sym ? -1 : 1;
+  // keep the table order for aliases
+  return ak < bk ? -1 : ak > bk;
+}
+
+static void
+init_keysyms(void)
+{
+  size_t i, n;
+
+  if (n_keysyms_by_value) return;
+  for (i = 0; i < N_KEYSYMS; i++)
+    keysyms_by_name[i] = keysyms_by_value[i] = &key_sym_mapping[i];
+  qsort(keysyms_by_name, N_KEYSYMS, sizeof(keysymmapping*), keysym_name_cmp);
+  qsort(keysyms_by_value, N_KEYSYMS, sizeof(keysymmapping*), keysym_value_cmp);
+  // Only keep the first name for each keysym value, which is what we want
+  // to print.
+  for (i = n = 1; i < N_KEYSYMS; i++)
+    if (keysyms_by_value[i]->sym != keysyms_by_value[n-1]->sym)
+      keysyms_by_value[n++] = keysyms_by_value[i];
+  n_keysyms_by_value = n;
+}
+
 KeySym
 string_to_KeySym(char *str)
 {
-  size_t len = strlen(str) + 1;
-  int i = 0;
+  keysymmapping key = { str, 0 }, *keyp = &key, **ret;
 
-  while (key_sym_mapping[i].str != NULL) {
-    if (!strncmp(str, key_sym_mapping[i].str, len)) {
-      return key_sym_mapping[i].sym;
-    }
-    i++;
-  }
-  return 0;
+  ret = bsearch(&keyp, keysyms_by_name, N_KEYSYMS, sizeof(keysymmapping*),
+		keysym_name_cmp);
+  return ret ? (*ret)->sym : 0;
 }
 
 char *
 KeySym_to_string(KeySym ks)
 {
-  int i = 0;
+  size_t lo = 0, hi = n_keysyms_by_value;
 
-  while (key_sym_mapping[i].sym != 0) {
-    if (key_sym_mapping[i].sym == ks) {
-      return key_sym_mapping[i].str;
-    }
-    i++;
+  while (lo < hi) {
+    size_t mid = (lo+hi)/2;
+    if (keysyms_by_value[mid]->sym < ks)
+      lo = mid+1;
+    else
+      hi = mid;
   }
+  if (lo < n_keysyms_by_value && keysyms_by_value[lo]->sym == ks)
+    return keysyms_by_value[lo]->str;
   return NULL;
 }
 
@@ -653,10 +1110,12 @@ static char *note_name(int n)
 
 static int note_octave(int n)
 {
+  // use the octave offset of the configuration being parsed, if any
+  int octave = cur_set ? cur_set->midi_octave : midi_octave;
   if (n < 0 && n%12)
-    return n/12-1 + midi_octave;
+    return n/12-1 + octave;
   else
-    return n/12 + midi_octave;
+    return n/12 + octave;
 }
 
 static int datavals(int val, int step, int *steps, int n_steps)
@@ -840,10 +1299,12 @@ int midi_channel;
 void
 append_stroke(KeySym sym, int press)
 {
-  stroke *s = (stroke *)allocate(sizeof(stroke));
+  stroke *s = (stroke *)arena_alloc(cur_arena, sizeof(stroke));
 
-  memset(s, 0, sizeof(stroke));
   s->keysym = sym;
+  // The key code gets filled in by refresh_keycodes() when the translations
+  // are installed. We can't do this here, since the parser may be running in
+  // a background thread, and Xlib isn't thread-safe.
   s->press = press;
   if (*first_stroke) {
     last_stroke->next = s;
@@ -856,9 +1317,8 @@ append_stroke(KeySym sym, int press)
 void
 append_shift(int shift)
 {
-  stroke *s = (stroke *)allocate(sizeof(stroke));
+  stroke *s = (stroke *)arena_alloc(cur_arena, sizeof(stroke));
 
-  memset(s, 0, sizeof(stroke));
   s->shift = shift;
   if (*first_stroke) {
     last_stroke->next = s;
@@ -871,9 +1331,8 @@ append_shift(int shift)
 void
 append_nop(void)
 {
-  stroke *s = (stroke *)allocate(sizeof(stroke));
+  stroke *s = (stroke *)arena_alloc(cur_arena, sizeof(stroke));
 
-  memset(s, 0, sizeof(stroke));
   if (*first_stroke) {
     last_stroke->next = s;
   } else {
@@ -887,9 +1346,8 @@ void
 append_midi(int status, int data, int step, int n_steps, int *steps,
 	    int swap, int change, int incr, int recursive, int feedback)
 {
-  stroke *s = (stroke *)allocate(sizeof(stroke));
+  stroke *s = (stroke *)arena_alloc(cur_arena, sizeof(stroke));
 
-  memset(s, 0, sizeof(stroke));
   s->status = status;
   s->data = data;
   s->swap = swap;
@@ -931,7 +1389,7 @@ mark_as_down(KeySym sym, int hold)
     }
   }
   if (modifier_count > NUM_MODIFIERS) {
-    fprintf(stderr, "too many modifiers down in [%s]%s\n", current_translation, key_name);
+    config_error("too many modifiers down in [%s]%s\n", current_translation, key_name);
     return;
   }
   modifiers_down[modifier_count].keysym = sym;
@@ -1158,7 +1616,7 @@ parse_midi(char *tok, char *s, int lhs, int mode, int recursive,
 	if ((*p == '-' || isdigit(*p)) &&
 	    sscanf(p, "%d%n", &m, &n) == 1) {
 	  // octave number
-	  m = k + 12 * (m - midi_octave);
+	  m = k + 12 * (m - cur_set->midi_octave);
 	  p += n;
 	} else {
 	  return 0;
@@ -1361,7 +1819,7 @@ parse_midi(char *tok, char *s, int lhs, int mode, int recursive,
     // we must be looking at a MIDI note here, with m denoting the
     // octave number; first character is the note name (must be a..g);
     // optionally, the second character may denote an accidental (# or b)
-    n = note_number(s[0], s[1], m - midi_octave);
+    n = note_number(s[0], s[1], m - cur_set->midi_octave);
     if (n < 0 || n > 127) return 0;
     *status = 0x90 | k; *data = n;
     return 1;
@@ -1374,46 +1832,6 @@ static int chk(stroke **s)
   return !s || *s;
 }
 
-static void dup_stroke_data(stroke_data **sd, uint16_t *n, uint16_t *a,
-			    stroke_data *sd0, uint16_t n0,
-			    stroke_data *sd1, uint16_t n1)
-{
-  for (int i = 0; i < n1; i++) {
-    if (sd1[i].anyshift) {
-      int nindex = sd1[i].mod?1:2; // no release seq in mod translations
-      for (int index = 0; index < nindex; index++) {
-	stroke **t =
-	  sd0 && check_stroke_data(sd0, sd1[i].chan, sd1[i].data, n0) ? 0 :
-	  find_stroke_data(sd, sd1[i].chan, sd1[i].data, index,
-			   sd1[i].step[index],
-			   sd1[i].n_steps[index], sd1[i].steps[index],
-			   sd1[i].is_incr, sd1[i].mod, 0,
-			   n, a);
-	// only add a default translation if we don't have one already
-	if (!chk(t)) {
-	  stroke *s = sd1[i].s[index];
-	  first_stroke = t;
-	  is_keystroke = 0;
-	  while (s) {
-	    if (s->keysym) {
-	      append_stroke(s->keysym, s->press);
-	    } else if (s->shift) {
-	      append_shift(s->shift);
-	    } else if (!s->status) {
-	      append_nop();
-	    } else {
-	      append_midi(s->status, s->data,
-			  s->step, s->n_steps, s->steps,
-			  s->swap, s->change, s->incr, s->recursive, s->feedback);
-	    }
-	    s = s->next;
-	  }
-	}
-      }
-    }
-  }
-}
-
 int
 start_translation(translation *tr, char *which_key)
 {
@@ -1424,7 +1842,7 @@ start_translation(translation *tr, char *which_key)
   //printf("start_translation(%s)\n", which_key);
 
   if (tr == NULL) {
-    fprintf(stderr, "missing translation section: %s\n", which_key);
+    config_error("missing translation section: %s\n", which_key);
     return 1;
   }
   current_translation = tr->name;
@@ -1436,16 +1854,17 @@ start_translation(translation *tr, char *which_key)
   modifier_count = 0;
   midi_channel = 0;
   int k = 0, offs = 0;
-  if (isdigit(which_key[0]) && which_key[1] == '^') {
-    offs = 2; k = which_key[0]-'0';
+  while (isdigit(which_key[offs]) && offs < 3) offs++;
+  if (offs && which_key[offs] == '^') {
+    k = atoi(which_key); offs++;
     if (k<0 || k>N_SHIFTS) {
-      fprintf(stderr, "invalid shift key: [%s]%s\n", current_translation, which_key);
+      config_error("invalid shift key: [%s]%s\n", current_translation, which_key);
       return 1;
     }
   } else if (*which_key == '^') {
     offs = k = 1;
   } else {
-    anyshift = 1;
+    offs = 0; anyshift = 1;
   }
   if (parse_midi(which_key+offs, buf, 1, 0, 0, &status, &data, &step, &n_steps, &steps, &incr, &dir, &mod, &swap, &change)) {
     int chan = status & 0x0f;
@@ -1455,7 +1874,7 @@ start_translation(translation *tr, char *which_key)
       if (incr) {
 	// note (step up, down)
 	if (step <= 0) {
-	  fprintf(stderr, "zero or negative step size not permitted here: [%s]%s\n", current_translation, which_key);
+	  config_error("zero or negative step size not permitted here: [%s]%s\n", current_translation, which_key);
 	  return 1;
 	}
 	first_stroke = find_notes(tr, k, chan, data, dir>0, step,
@@ -1495,7 +1914,7 @@ start_translation(translation *tr, char *which_key)
       if (incr) {
 	// cc (step up, down)
 	if (step <= 0) {
-	  fprintf(stderr, "zero or negative step size not permitted here: [%s]%s\n", current_translation, which_key);
+	  config_error("zero or negative step size not permitted here: [%s]%s\n", current_translation, which_key);
 	  return 1;
 	}
 	first_stroke = find_ccs(tr, k, chan, data, dir>0, step, incr>1,
@@ -1530,7 +1949,7 @@ start_translation(translation *tr, char *which_key)
       if (incr) {
 	// kp (step up, down)
 	if (step <= 0) {
-	  fprintf(stderr, "zero or negative step size not permitted here: [%s]%s\n", current_translation, which_key);
+	  config_error("zero or negative step size not permitted here: [%s]%s\n", current_translation, which_key);
 	  return 1;
 	}
 	first_stroke = find_kps(tr, k, chan, data, dir>0, step,
@@ -1558,7 +1977,7 @@ start_translation(translation *tr, char *which_key)
       if (incr) {
 	// cp (step up, down)
 	if (step <= 0) {
-	  fprintf(stderr, "zero or negative step size not permitted here: [%s]%s\n", current_translation, which_key);
+	  config_error("zero or negative step size not permitted here: [%s]%s\n", current_translation, which_key);
 	  return 1;
 	}
 	first_stroke = find_cps(tr, k, chan, dir>0, step,
@@ -1586,7 +2005,7 @@ start_translation(translation *tr, char *which_key)
       if (incr) {
 	// pb (step up, down)
 	if (step <= 0) {
-	  fprintf(stderr, "zero or negative step size not permitted here: [%s]%s\n", current_translation, which_key);
+	  config_error("zero or negative step size not permitted here: [%s]%s\n", current_translation, which_key);
 	  return 1;
 	}
 	first_stroke = find_pbs(tr, k, chan, dir>0, step,
@@ -1612,16 +2031,16 @@ start_translation(translation *tr, char *which_key)
       break;
     default:
       // this can't happen
-      fprintf(stderr, "unexpected error: [%s]%s\n", current_translation, which_key);
+      config_error("unexpected error: [%s]%s\n", current_translation, which_key);
       return 1;
     }
   } else {
-    fprintf(stderr, "syntax error: [%s]%s\n", current_translation, which_key);
+    config_error("syntax error: [%s]%s\n", current_translation, which_key);
     return 1;
   }
   if (chk(first_stroke) ||
       (is_bidirectional && chk(release_first_stroke))) {
-    fprintf(stderr, "already defined: [%s]%s\n", current_translation, which_key);
+    config_error("already defined: [%s]%s\n", current_translation, which_key);
     return 1;
   }
   press_first_stroke = first_stroke;
@@ -1723,7 +2142,7 @@ add_keystroke(char *keySymName, int press_release)
   if (sym != 0) {
     add_keysym(sym, press_release);
   } else {
-    fprintf(stderr, "unrecognized keysym: %s\n", keySymName);
+    config_error("unrecognized keysym: %s\n", keySymName);
   }
 }
 
@@ -1745,7 +2164,7 @@ add_midi(char *tok)
   int recursive = *tok == '$', fb = *tok == '!', fb2 = *tok == '^';
   char buf[100];
   if (fb2 && mode != 1) {
-    fprintf(stderr, "shift feedback only allowed in key translations: %s\n", tok);
+    config_error("shift feedback only allowed in key translations: %s\n", tok);
     return;
   }
   if (parse_midi(tok+recursive+fb+fb2, buf, 0, mode, recursive, &status, &data, &step, &n_steps, &steps, &incr, &dir, &mod, &swap, &change)) {
@@ -1754,7 +2173,7 @@ add_midi(char *tok)
       // the default MIDI channel
       midi_channel = data;
       if (recursive)
-	fprintf(stderr, "invalid macro call: %s\n", tok);
+	config_error("invalid macro call: %s\n", tok);
     } else {
       append_midi(status, data, step, n_steps, steps,
 		  swap, change, incr!=0, recursive, fb2?2:fb);
@@ -1763,9 +2182,9 @@ add_midi(char *tok)
     // inspect the token that was actually recognized (if any) to give some
     // useful error message here
     if (strcmp(buf, "ch"))
-      fprintf(stderr, "syntax error: %s\n", tok);
+      config_error("syntax error: %s\n", tok);
     else
-      fprintf(stderr, "invalid MIDI channel: %s\n", tok);
+      config_error("invalid MIDI channel: %s\n", tok);
   }
 }
 
@@ -1777,7 +2196,7 @@ finish_translation(void)
     add_release(0);
   }
   add_release(1);
-  if (debug_strokes) {
+  if (cur_set->debug_strokes) {
     if (is_keystroke) {
       print_stroke_sequence(key_name, "D", *press_first_stroke, 0, 0, 0, 0, 0);
       print_stroke_sequence(key_name, "U", *release_first_stroke, 0, 0, 0, 0, 0);
@@ -1788,20 +2207,13 @@ finish_translation(void)
   }
 }
 
-int
-read_config_file(void)
+// Check whether the config file needs to be (re)loaded. Returns the opened
+// file if so, NULL otherwise.
+static FILE *
+open_config_file(void)
 {
   struct stat buf;
   char *home;
-  char *line;
-  char *s;
-  char *name = NULL;
-  char *regex;
-  char *tok;
-  char *which_key;
-  char *updown;
-  char delim;
-  translation *tr = NULL;
   FILE *f;
   int config_file_default = 0;
   static int errors = 0;
@@ -1831,13 +2243,16 @@ read_config_file(void)
       perror(config_file_name);
       errors++;
     }
+    // watch out for the file being created
+    update_config_watch();
     return 0;
   }
   if (buf.st_mtime == 0) {
     buf.st_mtime = 1;
   }
-  if (buf.st_mtime > config_file_modification_time) {
+  if (buf.st_mtime > config_file_modification_time || includes_changed()) {
     config_file_modification_time = buf.st_mtime;
+    update_config_watch();
     if (default_debug_regex || default_debug_strokes || default_debug_keys ||
 	default_debug_midi) {
       printf("Loading configuration: %s\n", config_file_name);
@@ -1849,137 +2264,87 @@ read_config_file(void)
 	perror(config_file_name);
 	errors++;
       }
-      return 0;
     }
+    return f;
+  } else {
+    return NULL;
+  }
+}
 
-    free_all_translations();
-    reload_callback();
-    debug_regex = default_debug_regex;
-    debug_strokes = default_debug_strokes;
-    debug_keys = default_debug_keys;
-    debug_midi = default_debug_midi;
-    midi_octave = 0;
+// Parse the config text into a new translation set. This doesn't touch the
+// installed translations, so it can be run in a background thread. Sections
+// which didn't change since the last load are taken over from the installed
+// set rather than being parsed again; this also keeps the state of their
+// controls. The text is tokenized in place, so it gets clobbered in the
+// process; text[len] must be writable.
+static translation_set *
+parse_config_file(char *text, size_t len)
+{
+  char *line, *next = text, *end = text+len;
+  char *s;
+  char *name = NULL;
+  char *regex;
+  char *tok;
+  char *which_key;
+  char *updown;
+  char delim;
+  translation *tr = NULL;
+  translation_set *ts = (translation_set *)allocate(sizeof(translation_set));
+  uint64_t *fingerprints = NULL;
+  int n_fingerprints = 0, n_headers = 0, skip = 0;
+
+  memset(ts, 0, sizeof(translation_set));
+  ts->debug_regex = default_debug_regex;
+  ts->debug_strokes = default_debug_strokes;
+  ts->debug_keys = default_debug_keys;
+  ts->debug_midi = default_debug_midi;
+  ts->jack_num_outputs = -1;
+  ts->passthrough[0] = ts->passthrough[1] = -1;
+  ts->system_passthrough[0] = ts->system_passthrough[1] = -1;
+  cur_set = ts;
+  cur_section = NULL;
+  cur_arena = &ts->mem;
+  n_fingerprints = section_fingerprints(text, len, &fingerprints);
+
+  while (next < end) {
+    line = next;
+    next = memchr(line, '\n', end-line);
+    if (next) {
+      *next++ = '\0';
+    } else {
+      next = end;
+      *end = '\0';
+    }
+    //printf("line: %s\n", line);
 
-    while ((line=read_line(f, config_file_name)) != NULL) {
-      //printf("line: %s", line);
-      
-      s = line;
-      while (*s && isspace(*s)) {
+    s = line;
+    while (*s && isspace(*s)) {
+      s++;
+    }
+    if (*s == '#') {
+      continue;
+    }
+    if (*s == '[') {
+      //  [name] regex\n
+      int mode = 0;
+      name = ++s;
+      while (*s && *s != ']') {
 	s++;
       }
-      if (*s == '#') {
-	continue;
-      }
-      if (*s == '[') {
-	//  [name] regex\n
-	int mode = 0;
-	name = ++s;
-	while (*s && *s != ']') {
-	  s++;
-	}
-	regex = NULL;
-	if (*s) {
-	  *s = '\0';
+      regex = NULL;
+      if (*s) {
+	*s = '\0';
+	s++;
+	while (*s && isspace(*s)) {
 	  s++;
-	  while (*s && isspace(*s)) {
-	    s++;
-	  }
-	  if (!strncmp(s, "TITLE", 5)) {
-	    mode = 1;
-	    s += 5;
-	  } else if (!strncmp(s, "CLASS", 5)) {
-	    mode = 2;
-	    s += 5;
-	  }
-	  while (*s && isspace(*s)) {
-	    s++;
-	  }
-	  regex = s;
-	  while (*s) {
-	    s++;
-	  }
-	  s--;
-	  while (s > regex && isspace(*s)) {
-	    s--;
-	  }
-	  s[1] = '\0';
-	}
-	finish_translation_section(tr);
-	tr = new_translation_section(name, mode, regex);
-	continue;
-      }
-
-      tok = token(s, &delim);
-      if (tok == NULL) {
-	continue;
-      }
-      if (!strcmp(tok, "DEBUG_REGEX")) {
-	debug_regex = 1; // -dr
-	continue;
-      }
-      if (!strcmp(tok, "DEBUG_STROKES")) {
-	debug_strokes = 1; // -ds
-	continue;
-      }
-      if (!strcmp(tok, "DEBUG_KEYS")) {
-	debug_keys = 1; // -dk
-	continue;
-      }
-      if (!strcmp(tok, "DEBUG_MIDI")) {
-	debug_midi = 1; // -dm
-	continue;
-      }
-      if (!strcmp(tok, "NO_FEEDBACK")) {
-	auto_feedback = 0; // -n
-	continue;
-      }
-      if (!strcmp(tok, "JACK_NAME")) {
-	char *a = token(NULL, &delim);
-	if (!jack_client_name) {
-	  static char buf[100];
-	  strncpy(buf, a, 100); buf[99] = 0; // just in case...
-	  jack_client_name = buf; // -j
-	}
-	continue;
-      }
-      if (!strcmp(tok, "JACK_PORTS")) {
-	char *a = token(NULL, &delim);
-	int k, n;
-	if (!jack_num_outputs) {
-	  if (sscanf(a, "%d%n", &k, &n) == 1 && !a[n] && k>=0 && k<=2) {
-	    jack_num_outputs = k; // -o
-	  } else {
-	    fprintf(stderr, "invalid port number: %s, must be 0, 1 or 2\n", a);
-	  }
-	}
-	continue;
-      }
-      if (!strncmp(tok, "JACK_", 5)) {
-	// JACK_IN/OUT. The port number follows (default: 1), then a regex
-	// (taken verbatim from the rest of the line).
-        char *s = tok+5, *regex;
-	int is_input = strncmp(s, "IN", 2) == 0;
-	if (is_input)
-	  s += 2;
-	else if (strncmp(s, "OUT", 3) == 0)
-	  s += 3;
-	else {
-	  fprintf(stderr, "invalid token: %s, must be JACK_IN or JACK_OUT\n",
-		  tok);
-	  continue;
 	}
-	int portno = !*s||*s=='1'?0:*s=='2'?1:-1;
-	if (portno < 0) {
-	  fprintf(stderr, "invalid port number: %s, must be 1 or 2\n", s);
-	  continue;
-	}
-	if (*s && *++s) {
-	  // trailing garbage
-	  fprintf(stderr, "invalid token: %s, must be JACK_IN or JACK_OUT\n",
-		  tok);
-	  continue;
+	if (!strncmp(s, "TITLE", 5)) {
+	  mode = 1;
+	  s += 5;
+	} else if (!strncmp(s, "CLASS", 5)) {
+	  mode = 2;
+	  s += 5;
 	}
-	s = token_src;
 	while (*s && isspace(*s)) {
 	  s++;
 	}
@@ -1992,139 +2357,617 @@ read_config_file(void)
 	  s--;
 	}
 	s[1] = '\0';
-	char **jack_regex = is_input?jack_in_regex:jack_out_regex;
-	if (jack_regex[portno]) {
-	  if (strcmp(jack_regex[portno], regex))
-	    fprintf(stderr, "error: attempt to redefine %s as '%s'\n(is already defined as '%s')\n", tok, regex, jack_regex[portno]);
-	} else {
-	  jack_regex[portno] = strdup(regex);
-	}
+      }
+      finish_translation_section(tr);
+      tr = NULL;
+      cur_section = NULL;
+      cur_arena = &ts->mem;
+      // The octave offset in effect also goes into the fingerprint, since
+      // the section depends on it.
+      uint64_t fingerprint = 0;
+      translation *old;
+      if (n_headers < n_fingerprints) {
+	fingerprint = fingerprints[n_headers] ^
+	  ((uint64_t)(ts->midi_octave+1) * 0x9e3779b97f4a7c15ULL);
+	if (!fingerprint) fingerprint = 1;
+      }
+      n_headers++;
+      if (!ts->debug_strokes &&
+	  (old = find_translation_section(current_set, fingerprint))) {
+	// unchanged, reuse the old section and skip over its translations
+	old->refs++;
+	add_translation_section(ts, old);
+	ts->errors += old->errors;
+	skip = 1;
 	continue;
       }
-      if (!strcmp(tok, "PASSTHROUGH")) { // -t
-	char *a = token(NULL, &delim);
-	int k, n;
-	if (a && *a && *a != '#') {
-	  if (sscanf(a, "%d%n", &k, &n) == 1 && !a[n] && k>=0 && k<=2) {
-	    if (passthrough[0] < 0) passthrough[0] = k==1;
-	    if (passthrough[1] < 0) passthrough[1] = k==2;
-	  } else {
-	    fprintf(stderr, "invalid port number: %s, must be 0, 1 or 2\n", a);
-	  }
+      skip = 0;
+      tr = new_translation_section(name, mode, regex);
+      if (tr) tr->fingerprint = fingerprint;
+      continue;
+    }
+
+    tok = token(s, &delim);
+    if (tok == NULL) {
+      continue;
+    }
+    if (!strcmp(tok, "DEBUG_REGEX")) {
+      ts->debug_regex = 1; // -dr
+      continue;
+    }
+    if (!strcmp(tok, "DEBUG_STROKES")) {
+      ts->debug_strokes = 1; // -ds
+      continue;
+    }
+    if (!strcmp(tok, "DEBUG_KEYS")) {
+      ts->debug_keys = 1; // -dk
+      continue;
+    }
+    if (!strcmp(tok, "DEBUG_MIDI")) {
+      ts->debug_midi = 1; // -dm
+      continue;
+    }
+    if (!strcmp(tok, "NO_FEEDBACK")) {
+      ts->no_feedback = 1; // -n
+      continue;
+    }
+    if (!strcmp(tok, "JACK_NAME")) {
+      char *a = token(NULL, &delim);
+      if (a && !ts->jack_client_name) {
+	ts->jack_client_name = arena_strdup(&ts->mem, a); // -j
+      }
+      continue;
+    }
+    if (!strcmp(tok, "JACK_PORTS")) {
+      char *a = token(NULL, &delim);
+      int k, n;
+      if (ts->jack_num_outputs < 0) {
+	if (a && sscanf(a, "%d%n", &k, &n) == 1 && !a[n] && k>=0 && k<=2) {
+	  ts->jack_num_outputs = k; // -o
 	} else {
-	  if (passthrough[0] < 0) passthrough[0] = 1;
-	  if (passthrough[1] < 0) passthrough[1] = 1;
+	  config_error("invalid port number: %s, must be 0, 1 or 2\n", a);
 	}
+      }
+      continue;
+    }
+    if (!strncmp(tok, "JACK_", 5)) {
+      // JACK_IN/OUT. The port number follows (default: 1), then a regex
+      // (taken verbatim from the rest of the line).
+      char *s = tok+5, *regex;
+      int is_input = strncmp(s, "IN", 2) == 0;
+      if (is_input)
+	s += 2;
+      else if (strncmp(s, "OUT", 3) == 0)
+	s += 3;
+      else {
+	config_error("invalid token: %s, must be JACK_IN or JACK_OUT\n",
+		     tok);
 	continue;
       }
-      if (!strcmp(tok, "SYSTEM_PASSTHROUGH")) { // -s
-	char *a = token(NULL, &delim);
-	int k, n;
-	if (a && *a && *a != '#') {
-	  if (sscanf(a, "%d%n", &k, &n) == 1 && !a[n] && k>=0 && k<=2) {
-	    if (system_passthrough[0] < 0) system_passthrough[0] = k==1;
-	    if (system_passthrough[1] < 0) system_passthrough[1] = k==2;
-	  } else {
-	    fprintf(stderr, "invalid port number: %s, must be 0, 1 or 2\n", a);
-	  }
+      int portno = !*s||*s=='1'?0:*s=='2'?1:-1;
+      if (portno < 0) {
+	config_error("invalid port number: %s, must be 1 or 2\n", s);
+	continue;
+      }
+      if (*s && *++s) {
+	// trailing garbage
+	config_error("invalid token: %s, must be JACK_IN or JACK_OUT\n",
+		     tok);
+	continue;
+      }
+      s = token_src;
+      while (*s && isspace(*s)) {
+	s++;
+      }
+      regex = s;
+      while (*s) {
+	s++;
+      }
+      s--;
+      while (s > regex && isspace(*s)) {
+	s--;
+      }
+      s[1] = '\0';
+      char **jack_regex = is_input?ts->jack_in_regex:ts->jack_out_regex;
+      if (jack_regex[portno]) {
+	if (strcmp(jack_regex[portno], regex))
+	  fprintf(stderr, "error: attempt to redefine %s as '%s'\n(is already defined as '%s')\n", tok, regex, jack_regex[portno]);
+      } else {
+	jack_regex[portno] = arena_strdup(&ts->mem, regex);
+      }
+      continue;
+    }
+    if (!strcmp(tok, "PASSTHROUGH")) { // -t
+      char *a = token(NULL, &delim);
+      int k, n;
+      if (a && *a && *a != '#') {
+	if (sscanf(a, "%d%n", &k, &n) == 1 && !a[n] && k>=0 && k<=2) {
+	  if (ts->passthrough[0] < 0) ts->passthrough[0] = k==1;
+	  if (ts->passthrough[1] < 0) ts->passthrough[1] = k==2;
 	} else {
-	  if (system_passthrough[0] < 0) system_passthrough[0] = 1;
-	  if (system_passthrough[1] < 0) system_passthrough[1] = 1;
+	  config_error("invalid port number: %s, must be 0, 1 or 2\n", a);
 	}
-	continue;
+      } else {
+	if (ts->passthrough[0] < 0) ts->passthrough[0] = 1;
+	if (ts->passthrough[1] < 0) ts->passthrough[1] = 1;
       }
-      if (!strncmp(tok, "MIDI_OCTAVE", 11)) {
-	char *a = tok+11;
-	int k, n;
-	if (!*a)
-	  // look for the offset in the next token
-	  a = token(NULL, &delim);
-	if (sscanf(a, "%d%n", &k, &n) == 1 && !a[n]) {
-	  midi_octave = k;
+      continue;
+    }
+    if (!strcmp(tok, "SYSTEM_PASSTHROUGH")) { // -s
+      char *a = token(NULL, &delim);
+      int k, n;
+      if (a && *a && *a != '#') {
+	if (sscanf(a, "%d%n", &k, &n) == 1 && !a[n] && k>=0 && k<=2) {
+	  if (ts->system_passthrough[0] < 0) ts->system_passthrough[0] = k==1;
+	  if (ts->system_passthrough[1] < 0) ts->system_passthrough[1] = k==2;
 	} else {
-	  fprintf(stderr, "invalid octave offset: %s\n", a);
+	  config_error("invalid port number: %s, must be 0, 1 or 2\n", a);
 	}
-	continue;
+      } else {
+	if (ts->system_passthrough[0] < 0) ts->system_passthrough[0] = 1;
+	if (ts->system_passthrough[1] < 0) ts->system_passthrough[1] = 1;
       }
-      which_key = tok;
-      if (start_translation(tr, which_key)) {
-	continue;
+      continue;
+    }
+    if (!strncmp(tok, "MIDI_OCTAVE", 11)) {
+      char *a = tok+11;
+      int k, n;
+      if (!*a)
+	// look for the offset in the next token
+	a = token(NULL, &delim);
+      if (sscanf(a, "%d%n", &k, &n) == 1 && !a[n]) {
+	ts->midi_octave = k;
+      } else {
+	config_error("invalid octave offset: %s\n", a);
       }
-      tok = token(NULL, &delim);
-      while (tok != NULL) {
-	if (delim != '"' && tok[0] == '#') {
-	  break; // skip rest as comment
-	}
-	//printf("token: [%s] delim [%d]\n", tok, delim);
-	switch (delim) {
-	case ' ':
-	case '\t':
-	case '\n':
-	case '\0': // no newline at eof
-	  if (!strcmp(tok, "RELEASE")) {
-	    // Suppress the default MIDI release sequence if there's an
-	    // explicit release sequence.
-	    explicit_release = 1;
-	    add_keystroke(tok, PRESS_RELEASE);
-	  } else if (!strncmp(tok, "SHIFT", 5)) {
-	    int shift = isdigit(tok[5])?tok[5]-'0':1;
-	    if ((tok[5] == 0 || (isdigit(tok[5]) && tok[6] == 0)) &&
-		shift >= 1 && shift <= N_SHIFTS)
-	      append_shift(shift);
-	    else
-	      fprintf(stderr, "invalid shift key: [%s]%s\n", name, tok);
-	  } else if (!strcmp(tok, "NOP"))
-	    append_nop();
-	  else if (strncmp(tok, "XK", 2))
-	    add_midi(tok);
+      continue;
+    }
+    if (skip) {
+      continue;
+    }
+    which_key = tok;
+    if (start_translation(tr, which_key)) {
+      continue;
+    }
+    tok = token(NULL, &delim);
+    while (tok != NULL) {
+      if (delim != '"' && tok[0] == '#') {
+	break; // skip rest as comment
+      }
+      //printf("token: [%s] delim [%d]\n", tok, delim);
+      switch (delim) {
+      case ' ':
+      case '\t':
+      case '\n':
+      case '\0': // no newline at eof
+	if (!strcmp(tok, "RELEASE")) {
+	  // Suppress the default MIDI release sequence if there's an
+	  // explicit release sequence.
+	  explicit_release = 1;
+	  add_keystroke(tok, PRESS_RELEASE);
+	} else if (!strncmp(tok, "SHIFT", 5)) {
+	  char *end = tok+5;
+	  int shift = isdigit(*end)?strtol(end, &end, 10):1;
+	  if (*end == 0 && shift >= 1 && shift <= N_SHIFTS)
+	    append_shift(shift);
 	  else
-	    add_keystroke(tok, PRESS_RELEASE);
-	  break;
-	case '"':
-	  add_string(tok);
-	  break;
-	default: // should be slash
-	  updown = token(NULL, &delim);
-	  if (updown != NULL) {
-	    switch (updown[0]) {
-	    case 'U':
-	      add_keystroke(tok, RELEASE);
-	      break;
-	    case 'D':
-	      add_keystroke(tok, PRESS);
-	      break;
-	    case 'H':
-	      add_keystroke(tok, HOLD);
-	      break;
-	    default:
-	      fprintf(stderr, "invalid up/down modifier [%s]%s: %s\n", name, which_key, updown);
-	      add_keystroke(tok, PRESS);
-	      break;
-	    }
+	    config_error("invalid shift key: [%s]%s\n", name, tok);
+	} else if (!strcmp(tok, "NOP"))
+	  append_nop();
+	else if (strncmp(tok, "XK", 2))
+	  add_midi(tok);
+	else
+	  add_keystroke(tok, PRESS_RELEASE);
+	break;
+      case '"':
+	add_string(tok);
+	break;
+      default: // should be slash
+	updown = token(NULL, &delim);
+	if (updown != NULL) {
+	  switch (updown[0]) {
+	  case 'U':
+	    add_keystroke(tok, RELEASE);
+	    break;
+	  case 'D':
+	    add_keystroke(tok, PRESS);
+	    break;
+	  case 'H':
+	    add_keystroke(tok, HOLD);
+	    break;
+	  default:
+	    config_error("invalid up/down modifier [%s]%s: %s\n", name, which_key, updown);
+	    add_keystroke(tok, PRESS);
+	    break;
 	  }
 	}
-	tok = token(NULL, &delim);
       }
-      finish_translation();
+      tok = token(NULL, &delim);
+    }
+    finish_translation();
+  }
+  finish_translation_section(tr);
+
+  free(fingerprints);
+  cur_set = NULL;
+  cur_section = NULL;
+  cur_arena = NULL;
+  return ts;
+}
+
+// Take over the unchanged sections of the installed set in a set loaded from
+// the cache, so that they keep the state of their controls.
+static void
+reuse_translation_sections(translation_set *ts)
+{
+  int i, k;
+
+  for (i = 0; i < ts->n_sections; i++) {
+    translation *tr = ts->sections[i], *old =
+      find_translation_section(current_set, tr->fingerprint);
+    if (!old) continue;
+    old->refs++;
+    ts->sections[i] = old;
+    if (ts->default_translation == tr)
+      ts->default_translation = old;
+    for (k = 0; k < 2; k++)
+      if (ts->default_midi_translation[k] == tr)
+	ts->default_midi_translation[k] = old;
+    free_translation_section(tr);
+  }
+}
+
+// Get the text of the config file. If map is set, the file is mapped
+// privately if possible, so that the parser can work on it in place without
+// copying it first. Otherwise, or if there's no room for the terminating
+// null byte at the end of the mapping, we read it into a buffer. Returns the
+// size of the mapping (0 if the text was read into a buffer), or -1 on
+// error. Only --check maps the file. The running program reloads the file
+// when it changes, and editors often rewrite it in place, so it may shrink
+// under the mapping (touching a page past the new end raises SIGBUS), and
+// the hash and the parser might get to see different text.
+static ssize_t
+map_config_file(FILE *f, char **text, size_t *len, int map)
+{
+  struct stat st;
+  long pagesize = sysconf(_SC_PAGESIZE);
+  size_t alloc = 0;
+  ssize_t n;
+
+  *text = NULL;
+  *len = 0;
+  memset(&st, 0, sizeof(st));
+  if (fstat(fileno(f), &st) == 0 && map && S_ISREG(st.st_mode) &&
+      st.st_size > 0 && st.st_size % pagesize) {
+    char *p = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE,
+		   fileno(f), 0);
+    if (p != MAP_FAILED) {
+      *text = p;
+      *len = st.st_size;
+      return st.st_size;
+    }
+  }
+  do {
+    if (*len + 1 >= alloc) {
+      char *p;
+      alloc = alloc ? 2*alloc : st.st_size > 0 ? (size_t)st.st_size+1 : 4096;
+      if (!(p = realloc(*text, alloc))) {
+	free(*text);
+	*text = NULL;
+	return -1;
+      }
+      *text = p;
     }
-    finish_translation_section(tr);
+    n = read(fileno(f), *text + *len, alloc - *len - 1);
+    if (n > 0) *len += n;
+  } while (n > 0);
+  if (n < 0) {
+    perror(config_file_name);
+    free(*text);
+    *text = NULL;
+    return -1;
+  }
+  return 0;
+}
 
-    fclose(f);
-    return 1;
+// Load a configuration, using the cached image of the file if it's up to
+// date (see cache.c), and parsing the file otherwise. Can be run in the
+// background just like parse_config_file().
+static translation_set *
+load_config_file(FILE *f)
+{
+  translation_set *ts = NULL;
+  text_buffer buf = { NULL, 0, 0 };
+  char *text;
+  size_t len;
+  ssize_t mapped;
+  uint64_t hash;
+  int include_errors;
+  PROF_BEGIN(prof_t);
+
+  mapped = map_config_file(f, &text, &len, 0);
+  if (mapped < 0) {
+    // we still need a set to install, even if it's empty
+    static char empty[1];
+    text = empty;
+    len = 0;
+  }
+  // Expand the includes, if any. This gives us the complete text, which we
+  // need to check the cache.
+  include_errors = expand_config_includes(text, len, &buf);
+  // We parse from the text we have now, and the parser clobbers it, so we
+  // need to hash it beforehand for the cache.
+  hash = hash_bytes(buf.data ? buf.data : text, buf.data ? buf.len : len);
+  // If we're asked to print the parsed translations, bypass the cache.
+  // Also, if an include failed, the text is incomplete and we don't want it
+  // in the cache.
+  if (!default_debug_strokes && !include_errors) {
+    ts = load_config_cache(config_file_name, buf.data ? buf.len : len, hash);
+    __atomic_fetch_add(ts ? &config_cache_hits : &config_cache_misses, 1,
+		       __ATOMIC_RELAXED);
+    if (ts && ts->debug_strokes) {
+      free_translation_set(ts);
+      ts = NULL;
+    } else if (ts) {
+      reuse_translation_sections(ts);
+    }
+  }
+  if (!ts) {
+    if (buf.data)
+      ts = parse_config_file(buf.data, buf.len);
+    else
+      ts = parse_config_file(text, len);
+    ts->errors += include_errors + (mapped < 0);
+    if (!ts->errors && !ts->debug_strokes)
+      save_config_cache(config_file_name, buf.data ? buf.len : len, hash, ts);
+  }
+  if (mapped > 0)
+    munmap(text, mapped);
+  else if (mapped == 0)
+    free(text);
+  free(buf.data);
+  PROF_END(PROF_RELOAD, prof_t);
+  return ts;
+}
 
-  } else {
+// Load the config file for checking it (see check.c). This always parses
+// the file, and the result doesn't get installed. We check whether there's a
+// valid cache, but don't write it. The time spent in each phase is recorded
+// in t.
+translation_set *
+load_config_for_check(config_timing *t)
+{
+  translation_set *ts;
+  text_buffer buf = { NULL, 0, 0 };
+  char *text;
+  size_t len;
+  ssize_t mapped;
+  uint64_t hash;
+  int include_errors;
+  double t0;
+  FILE *f;
+
+  init_keysyms();
+  config_file_modification_time = 0;
+  f = open_config_file();
+  if (f == NULL) return NULL;
+  t0 = get_msecs();
+  mapped = map_config_file(f, &text, &len, 1);
+  fclose(f);
+  if (mapped < 0) return NULL;
+  t->read = get_msecs() - t0;
+  t0 = get_msecs();
+  include_errors = expand_config_includes(text, len, &buf);
+  if (buf.data) {
+    if (mapped > 0) munmap(text, mapped); else free(text);
+    text = buf.data;
+    len = buf.len;
+    mapped = 0;
+  }
+  t->include = get_msecs() - t0;
+  t0 = get_msecs();
+  hash = hash_bytes(text, len);
+  t->hash = get_msecs() - t0;
+  t0 = get_msecs();
+  ts = load_config_cache(config_file_name, len, hash);
+  t->cache = get_msecs() - t0;
+  if (ts) {
+    t->cached = 1;
+    free_translation_set(ts);
+  }
+  timing = t;
+  t0 = get_msecs();
+  ts = parse_config_file(text, len);
+  t->parse = get_msecs() - t0;
+  timing = NULL;
+  ts->errors += include_errors;
+  if (mapped > 0) munmap(text, mapped); else free(text);
+  return ts;
+}
+
+// Apply the Jack-related settings from the config file. Command line options
+// take priority, and these only have an effect at startup anyway, so we
+// only fill in what hasn't been set yet.
+static void
+install_jack_settings(translation_set *ts)
+{
+  int k;
+
+  if (ts->jack_client_name && !jack_client_name) {
+    static char buf[100];
+    strncpy(buf, ts->jack_client_name, 100); buf[99] = 0; // just in case...
+    jack_client_name = buf;
+  }
+  if (ts->jack_num_outputs >= 0 && !jack_num_outputs)
+    jack_num_outputs = ts->jack_num_outputs;
+  for (k = 0; k < 2; k++) {
+    int i;
+    for (i = 0; i < 2; i++) {
+      char *regex = i ? ts->jack_out_regex[k] : ts->jack_in_regex[k];
+      char **jack_regex = i ? jack_out_regex : jack_in_regex;
+      if (!regex) continue;
+      if (jack_regex[k]) {
+	if (strcmp(jack_regex[k], regex))
+	  fprintf(stderr, "error: attempt to redefine JACK_%s%d as '%s'\n(is already defined as '%s')\n", i?"OUT":"IN", k+1, regex, jack_regex[k]);
+      } else {
+	jack_regex[k] = strdup(regex);
+      }
+    }
+    if (passthrough[k] < 0)
+      passthrough[k] = ts->passthrough[k];
+    if (system_passthrough[k] < 0)
+      system_passthrough[k] = ts->system_passthrough[k];
+  }
+}
+
+// Install a new translation set, replacing the current one, which is freed.
+// This must be called from the main thread. A set with errors is rejected,
+// except on the initial load, where we take what we can get.
+static int
+install_translation_set(translation_set *ts)
+{
+  translation_set *old = current_set;
+  int changed = 1;
+
+  if (old && ts->errors) {
+    fprintf(stderr, "%s: %d error%s, keeping previous configuration\n",
+	    config_file_name, ts->errors, ts->errors>1?"s":"");
+    free_translation_set(ts);
+    config_rejects++;
     return 0;
   }
+  config_loads++;
+  PROF_BEGIN(prof_t);
+  // The trace thread may still be printing messages which refer to the old
+  // configuration.
+  sync_trace();
+  // If all sections are the same as before, the focus state in the main
+  // loop is still valid, and we don't need to reset it.
+  if (old && old->n_sections == ts->n_sections &&
+      !memcmp(old->sections, ts->sections,
+	      ts->n_sections*sizeof(translation*)) &&
+      old->default_translation == ts->default_translation &&
+      old->default_midi_translation[0] == ts->default_midi_translation[0] &&
+      old->default_midi_translation[1] == ts->default_midi_translation[1])
+    changed = 0;
+  current_set = ts;
+  default_translation = ts->default_translation;
+  default_midi_translation[0] = ts->default_midi_translation[0];
+  default_midi_translation[1] = ts->default_midi_translation[1];
+  debug_regex = ts->debug_regex;
+  debug_strokes = ts->debug_strokes;
+  debug_keys = ts->debug_keys;
+  debug_midi = ts->debug_midi;
+  midi_octave = ts->midi_octave;
+  if (ts->no_feedback) auto_feedback = 0;
+  install_jack_settings(ts);
+  if (changed) reload_callback();
+  refresh_keycodes();
+  free_translation_set(old);
+  PROF_END(PROF_INSTALL, prof_t);
+  return 1;
+}
+
+// Load the config file synchronously. This is used for the initial load,
+// and on reload if we can't do it in the background. Returns 1 if a new
+// configuration was installed.
+int
+read_config_file(void)
+{
+  FILE *f;
+  translation_set *ts;
+
+  init_keysyms();
+  f = open_config_file();
+  if (f == NULL) return 0;
+  ts = load_config_file(f);
+  fclose(f);
+  return install_translation_set(ts);
+}
+
+// Reloading in the background. The new configuration gets parsed in a
+// separate thread, so that the main thread can go on translating MIDI
+// input in the meantime. When the parser is done, it signals reload_fd,
+// upon which the main thread calls finish_config_reload() to install the
+// new configuration.
+
+static int reload_fd = -1;
+static int reloading = 0;
+static pthread_t reload_thread;
+
+static void *
+reload_thread_proc(void *arg)
+{
+  FILE *f = (FILE *)arg;
+  translation_set *ts = load_config_file(f);
+  uint64_t one = 1;
+
+  fclose(f);
+  if (write(reload_fd, &one, sizeof(one)) < 0)
+    perror("reload thread");
+  return ts;
+}
+
+int
+init_config_reload(void)
+{
+  reload_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+  if (reload_fd < 0) {
+    perror("eventfd");
+  }
+  return reload_fd;
+}
+
+// Check whether the config file changed, and start reloading it if needed.
+// Returns 1 if a new configuration was installed right away (this only
+// happens if we can't reload in the background).
+int
+reload_config_file(void)
+{
+  FILE *f;
+
+  if (reload_fd < 0) return read_config_file();
+  // If we're still busy with the previous reload, finish_config_reload()
+  // will check again when it's done.
+  if (reloading) return 0;
+  f = open_config_file();
+  if (f == NULL) return 0;
+  if (pthread_create(&reload_thread, NULL, reload_thread_proc, f)) {
+    translation_set *ts;
+    perror("pthread_create");
+    ts = load_config_file(f);
+    fclose(f);
+    return install_translation_set(ts);
+  }
+  reloading = 1;
+  return 0;
+}
+
+// Install the configuration from a finished background reload. Returns 1 if
+// a new configuration was installed.
+int
+finish_config_reload(void)
+{
+  uint64_t n;
+  void *ts;
+  int ret;
+
+  if (!reloading || read(reload_fd, &n, sizeof(n)) < 0) return 0;
+  pthread_join(reload_thread, &ts);
+  reloading = 0;
+  ret = install_translation_set((translation_set *)ts);
+  // the file may have changed again in the meantime
+  return reload_config_file() || ret;
 }
 
 translation *
 get_translation(char *win_title, char *win_class)
 {
   translation *tr;
+  int i;
 
-  read_config_file();
-  tr = first_translation_section;
-  while (tr != NULL) {
+  for (i = 0; current_set && i < current_set->n_sections; i++) {
+    tr = current_set->sections[i];
     if (!tr->is_default) {
       // AG: We first try to match the class name, since it usually provides
       // better identification clues.
@@ -2137,7 +2980,13 @@ get_translation(char *win_title, char *win_class)
 	return tr;
       }
     }
-    tr = tr->next;
   }
   return NULL;
 }
+
+// The installed configuration (main thread only).
+translation_set *
+get_translation_set(void)
+{
+  return current_set;
+}
@@ -0,0 +1,438 @@
+
+/*
+
+  Replaying MIDI input without Jack and X (midizap --replay).
+
+  This reads a Standard MIDI File or a capture file (see midizap.h for the
+  format) and feeds the MIDI messages in it through the translations of the
+  config file, as fast as possible. The window focus can be scripted with
+  a text file containing lines of the form 'msecs class title', giving the
+  time (in milliseconds from the start of the input) at which a window with
+  the given class and title gets focused. Focus changes in a capture file
+  are replayed as well. All MIDI and key output is written to a text file,
+  one event per line, and the throughput is reported at the end.
+
+*/
+
+#include "midizap.h"
+
+int replaying = 0;
+
+// The heap allocation counter, if bench/alloccount.so is preloaded.
+extern unsigned long alloc_count(void) __attribute__((weak));
+
+typedef struct {
+  double time; // in msecs (ticks while reading a MIDI file)
+  int seq; // position in the input, so that the order of events is kept
+  uint8_t type, port, len;
+  uint8_t msg[3];
+  // focus changes
+  char *win_class, *win_title;
+} replay_event;
+
+static replay_event *events = NULL;
+static int n_events = 0, a_events = 0;
+
+static FILE *out;
+static char out_buf[BUFSIZ];
+static double replay_time;
+static long n_midi_out, n_keys_out;
+
+static replay_event *
+add_event(double time, int type, int port)
+{
+  replay_event *ev;
+  if (n_events >= a_events) {
+    a_events = a_events ? 2*a_events : 1024;
+    events = realloc(events, a_events*sizeof(replay_event));
+    if (!events) {
+      fprintf(stderr, "Memory allocation failed\n");
+      exit(1);
+    }
+  }
+  ev = &events[n_events];
+  memset(ev, 0, sizeof(*ev));
+  ev->time = time;
+  ev->seq = n_events++;
+  ev->type = type;
+  ev->port = port;
+  return ev;
+}
+
+static int
+event_cmp(const void *a, const void *b)
+{
+  const replay_event *ae = (const replay_event*)a;
+  const replay_event *be = (const replay_event*)b;
+  if (ae->time != be->time) return ae->time < be->time ? -1 : 1;
+  // focus changes take effect before MIDI input at the same time
+  if (ae->type != be->type) return ae->type == CAPTURE_FOCUS ? -1 : 1;
+  return ae->seq - be->seq;
+}
+
+// We measure the cpu time rather than the wall clock time here, so that the
+// throughput figures aren't skewed by whatever else is running on the
+// machine.
+static double
+get_msecs(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec*1000.0 + ts.tv_nsec/1000000.0;
+}
+
+static char *
+read_file(char *name, size_t *len)
+{
+  FILE *f = fopen(name, "rb");
+  struct stat st;
+  char *buf;
+
+  if (!f) {
+    perror(name);
+    return NULL;
+  }
+  if (fstat(fileno(f), &st) < 0 ||
+      !(buf = malloc(st.st_size+1)) ||
+      fread(buf, 1, st.st_size, f) != (size_t)st.st_size) {
+    fprintf(stderr, "%s: error reading file\n", name);
+    fclose(f);
+    return NULL;
+  }
+  fclose(f);
+  buf[st.st_size] = 0;
+  *len = st.st_size;
+  return buf;
+}
+
+// Standard MIDI Files. Format 0 and 1 are supported. The tracks are merged
+// and the tempo map is applied to get the event times. A MIDI port meta
+// event (FF 21) in a track selects the input port (0 or 1) of the
+// following events in that track. Meta events and sysex are ignored.
+
+static uint32_t
+get_be(uint8_t *p, int n)
+{
+  uint32_t v = 0;
+  while (n-- > 0) v = (v<<8) | *p++;
+  return v;
+}
+
+static int
+get_varlen(uint8_t **p, uint8_t *end, uint32_t *v)
+{
+  int i;
+  *v = 0;
+  for (i = 0; i < 4 && *p < end; i++) {
+    uint8_t c = *(*p)++;
+    *v = (*v<<7) | (c & 0x7f);
+    if (!(c & 0x80)) return 1;
+  }
+  return 0;
+}
+
+typedef struct {
+  double tick;
+  uint32_t tempo; // usecs per quarter
+} tempo_change;
+
+static int
+tempo_cmp(const void *a, const void *b)
+{
+  const tempo_change *at = (const tempo_change*)a;
+  const tempo_change *bt = (const tempo_change*)b;
+  return at->tick < bt->tick ? -1 : at->tick > bt->tick;
+}
+
+static int
+read_midi_file(char *name, uint8_t *buf, size_t len)
+{
+  uint8_t *p = buf, *end = buf+len;
+  int format, n_tracks, division, t;
+  tempo_change *tempi = NULL;
+  int n_tempi = 0, first = n_events;
+
+  if (len < 14 || get_be(p+4, 4) < 6) goto bad;
+  format = get_be(p+8, 2);
+  n_tracks = get_be(p+10, 2);
+  division = get_be(p+12, 2);
+  if (format > 1) {
+    fprintf(stderr, "%s: MIDI file format %d not supported\n", name, format);
+    return 0;
+  }
+  p += 8 + get_be(p+4, 4);
+  for (t = 0; t < n_tracks && p+8 <= end; t++) {
+    uint8_t *q, *tend;
+    uint32_t tick = 0, delta;
+    uint8_t status = 0;
+    int port = 0;
+    if (memcmp(p, "MTrk", 4)) goto bad;
+    q = p+8; tend = q + get_be(p+4, 4);
+    if (tend > end) goto bad;
+    p = tend;
+    while (q < tend) {
+      uint8_t c;
+      uint32_t n;
+      if (!get_varlen(&q, tend, &delta) || q >= tend) goto bad;
+      tick += delta;
+      c = *q;
+      if (c == 0xff) {
+	uint8_t type;
+	if (q+2 > tend) goto bad;
+	type = q[1]; q += 2;
+	if (!get_varlen(&q, tend, &n) || q+n > tend) goto bad;
+	if (type == 0x51 && n == 3) {
+	  tempi = realloc(tempi, (n_tempi+1)*sizeof(tempo_change));
+	  if (!tempi) goto nomem;
+	  tempi[n_tempi].tick = tick;
+	  tempi[n_tempi++].tempo = get_be(q, 3);
+	} else if (type == 0x21 && n == 1)
+	  port = *q;
+	else if (type == 0x2f)
+	  break;
+	q += n;
+	status = 0;
+      } else if (c == 0xf0 || c == 0xf7) {
+	q++;
+	if (!get_varlen(&q, tend, &n) || q+n > tend) goto bad;
+	q += n;
+	status = 0;
+      } else {
+	int n_data;
+	replay_event *ev;
+	if (c & 0x80)
+	  status = *q++;
+	else if (!status)
+	  goto bad;
+	n_data = (status & 0xe0) == 0xc0 ? 1 : 2;
+	if (q+n_data > tend) goto bad;
+	// only ports 0 and 1 are available
+	if (port <= 1) {
+	  ev = add_event(tick, CAPTURE_MIDI, port);
+	  ev->len = n_data+1;
+	  ev->msg[0] = status;
+	  memcpy(ev->msg+1, q, n_data);
+	}
+	q += n_data;
+      }
+    }
+  }
+  qsort(events+first, n_events-first, sizeof(replay_event), event_cmp);
+  // convert ticks to msecs
+  if (division & 0x8000) {
+    // SMPTE time
+    double ticks_per_sec = -(int8_t)(division>>8) * (division & 0xff);
+    for (t = first; t < n_events; t++)
+      events[t].time *= 1000.0/ticks_per_sec;
+  } else {
+    double last_tick = 0, last_time = 0;
+    uint32_t tempo = 500000;
+    int i = 0;
+    if (!division) goto bad;
+    if (n_tempi) qsort(tempi, n_tempi, sizeof(tempo_change), tempo_cmp);
+    for (t = first; t < n_events; t++) {
+      double tick = events[t].time;
+      while (i < n_tempi && tempi[i].tick <= tick) {
+	last_time += (tempi[i].tick-last_tick)*tempo/division/1000.0;
+	last_tick = tempi[i].tick;
+	tempo = tempi[i++].tempo;
+      }
+      events[t].time = last_time + (tick-last_tick)*tempo/division/1000.0;
+    }
+  }
+  free(tempi);
+  return 1;
+ bad:
+  fprintf(stderr, "%s: bad MIDI file\n", name);
+  free(tempi);
+  return 0;
+ nomem:
+  fprintf(stderr, "Memory allocation failed\n");
+  exit(1);
+}
+
+static int
+read_capture_file(char *name, uint8_t *buf, size_t len)
+{
+  capture_header h;
+  capture_record r;
+  uint8_t *p = buf+sizeof(h), *end = buf+len;
+  uint32_t last_frames = 0;
+  double frames = 0;
+
+  memcpy(&h, buf, sizeof(h));
+  if (!h.rate) goto bad;
+  while (p+sizeof(r) <= end) {
+    replay_event *ev;
+    memcpy(&r, p, sizeof(r));
+    p += sizeof(r);
+    if (p+r.len > end) goto bad;
+    // Frame times wrap around, so only the differences count. Focus
+    // changes and MIDI input are recorded by different threads, so the
+    // records may also be slightly out of order.
+    if (p > buf+sizeof(h)+sizeof(r))
+      frames += (int32_t)(r.frames-last_frames);
+    last_frames = r.frames;
+    if (r.type == CAPTURE_MIDI) {
+      if (r.len < 1 || r.port > 1) goto bad;
+      // sysex isn't replayed
+      if (r.len <= 3) {
+	ev = add_event(frames*1000.0/h.rate, r.type, r.port);
+	ev->len = r.len;
+	memcpy(ev->msg, p, r.len);
+      }
+    } else if (r.type == CAPTURE_FOCUS) {
+      char *win_class = (char*)p, *win_title;
+      win_title = memchr(win_class, 0, r.len);
+      if (!win_title++ || !memchr(win_title, 0, (char*)p+r.len-win_title))
+	goto bad;
+      ev = add_event(frames*1000.0/h.rate, r.type, 0);
+      ev->win_class = win_class;
+      ev->win_title = win_title;
+    }
+    // other record types are skipped
+    p += r.len;
+  }
+  return 1;
+ bad:
+  fprintf(stderr, "%s: bad capture file\n", name);
+  return 0;
+}
+
+static int
+read_focus_script(char *name)
+{
+  FILE *f = fopen(name, "r");
+  char buf[2*1024], *s;
+  int lineno = 0;
+
+  if (!f) {
+    perror(name);
+    return 0;
+  }
+  while ((s = fgets(buf, sizeof(buf), f))) {
+    replay_event *ev;
+    char *win_class, *end;
+    double time;
+    lineno++;
+    s[strcspn(s, "\r\n")] = 0;
+    while (isspace(*s)) s++;
+    if (!*s || *s == '#') continue;
+    time = strtod(s, &end);
+    if (end == s || !isspace(*end)) {
+      fprintf(stderr, "%s:%d: bad focus change, must be 'msecs class title'\n", name, lineno);
+      fclose(f);
+      return 0;
+    }
+    s = end;
+    while (isspace(*s)) s++;
+    win_class = s;
+    while (*s && !isspace(*s)) s++;
+    if (*s) *s++ = 0;
+    while (isspace(*s)) s++;
+    ev = add_event(time, CAPTURE_FOCUS, 0);
+    ev->win_class = strdup(win_class);
+    ev->win_title = strdup(s);
+  }
+  fclose(f);
+  return 1;
+}
+
+// Output of the translations.
+
+void
+replay_midi(uint8_t *msg, uint8_t portno)
+{
+  int status = msg[0] & 0xf0;
+  fprintf(out, "%.3f midi%d %02x %02x", replay_time, portno+1,
+	  msg[0], msg[1]);
+  if (status != 0xc0 && status != 0xd0)
+    fprintf(out, " %02x", msg[2]);
+  fputc('\n', out);
+  n_midi_out++;
+}
+
+void
+replay_key(KeySym key, int press)
+{
+  char *name = KeySym_to_string(key);
+  if (name)
+    fprintf(out, "%.3f key %s/%c\n", replay_time, name, press?'D':'U');
+  else
+    fprintf(out, "%.3f key 0x%x/%c\n", replay_time, (int)key, press?'D':'U');
+  n_keys_out++;
+}
+
+int
+replay(char *name, char *focus_name, char *out_name)
+{
+  char *buf;
+  size_t len;
+  long n_in = 0;
+  unsigned long n_allocs = 0;
+  double t0, t;
+  int i, ok;
+
+  if (!(buf = read_file(name, &len))) return 1;
+  if (len >= 4 && !memcmp(buf, "MThd", 4))
+    ok = read_midi_file(name, (uint8_t*)buf, len);
+  else if (len >= sizeof(capture_header) && !memcmp(buf, CAPTURE_MAGIC, 4))
+    ok = read_capture_file(name, (uint8_t*)buf, len);
+  else {
+    fprintf(stderr, "%s: not a MIDI or capture file\n", name);
+    ok = 0;
+  }
+  if (!ok || (focus_name && !read_focus_script(focus_name))) return 1;
+  qsort(events, n_events, sizeof(replay_event), event_cmp);
+
+  if (!out_name || !strcmp(out_name, "-"))
+    out = stdout;
+  else if (!(out = fopen(out_name, "w"))) {
+    perror(out_name);
+    return 1;
+  }
+  // Load the configuration and set up the ports like main() does.
+  if (!read_config_file()) return 1;
+  passthrough[0] = jack_num_outputs>0?passthrough[0]>0:0;
+  passthrough[1] = jack_num_outputs>1?passthrough[1]>0:0;
+  // Give the output file a buffer of its own, so that stdio doesn't have to
+  // allocate one when the first event comes out. (stdout already has its
+  // buffer at this point.)
+  if (out != stdout) setvbuf(out, out_buf, _IOFBF, sizeof(out_buf));
+  // Look up each window once beforehand. glibc's regex matcher builds its
+  // DFA states lazily, allocating memory the first time it sees new input,
+  // which happens when a window is first focused in a live session. This
+  // gives us the steady state of a session where all the windows have
+  // already been visited.
+  for (i = 0; i < n_events; i++)
+    if (events[i].type == CAPTURE_FOCUS)
+      (void)get_translation(events[i].win_title, events[i].win_class);
+
+  replaying = 1;
+  if (alloc_count) n_allocs = alloc_count();
+  t0 = get_msecs();
+  for (i = 0; i < n_events; i++) {
+    replay_event *ev = &events[i];
+    replay_time = ev->time;
+    if (ev->type == CAPTURE_FOCUS)
+      set_replay_focus(ev->win_class, ev->win_title);
+    else if (ev->msg[0] < 0xf0 && (ev->port == 0 || jack_num_outputs > 1)) {
+      // system messages are never translated, and the second input port
+      // only exists with -o2
+      PROF_BEGIN(prof_t);
+      handle_event(ev->msg, ev->port, 0, 0);
+      PROF_END(PROF_EVENT, prof_t);
+      n_in++;
+    }
+  }
+  t = get_msecs() - t0;
+  if (alloc_count) n_allocs = alloc_count() - n_allocs;
+  replaying = 0;
+  if (out != stdout) fclose(out); else fflush(out);
+  fprintf(stderr, "%ld events in %.3f ms (%.0f events/s), %ld MIDI messages and %ld key events out\n",
+	  n_in, t, t>0?n_in*1000.0/t:0, n_midi_out, n_keys_out);
+  if (alloc_count)
+    fprintf(stderr, "%lu heap allocations\n", n_allocs);
+  print_profile();
+  return 0;
+}
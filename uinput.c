@@ -0,0 +1,252 @@
+
+/*
+
+ Key and mouse output through a virtual uinput device. This is used in lieu
+ of XTest (-u option), which also works on Wayland and on the Linux console.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <linux/input.h>
+#include <linux/uinput.h>
+
+#include <X11/keysym.h>
+
+#include "uinput.h"
+
+static int uinput_fd = -1;
+
+// Events are collected here and written to the device in one go by
+// uinput_flush(), which is invoked once per batch of input events.
+#define MAX_EVENTS 1024
+static struct input_event events[MAX_EVENTS];
+static int n_events = 0;
+
+// Mapping of X keysyms to evdev key codes. This assumes a US keyboard
+// layout; like with XTest, the keysyms denote keys, so shifted symbols are
+// mapped to the corresponding unshifted keys.
+
+static struct {
+  KeySym sym;
+  int code;
+} keymap[] = {
+  { XK_a, KEY_A }, { XK_b, KEY_B }, { XK_c, KEY_C }, { XK_d, KEY_D },
+  { XK_e, KEY_E }, { XK_f, KEY_F }, { XK_g, KEY_G }, { XK_h, KEY_H },
+  { XK_i, KEY_I }, { XK_j, KEY_J }, { XK_k, KEY_K }, { XK_l, KEY_L },
+  { XK_m, KEY_M }, { XK_n, KEY_N }, { XK_o, KEY_O }, { XK_p, KEY_P },
+  { XK_q, KEY_Q }, { XK_r, KEY_R }, { XK_s, KEY_S }, { XK_t, KEY_T },
+  { XK_u, KEY_U }, { XK_v, KEY_V }, { XK_w, KEY_W }, { XK_x, KEY_X },
+  { XK_y, KEY_Y }, { XK_z, KEY_Z },
+  { XK_A, KEY_A }, { XK_B, KEY_B }, { XK_C, KEY_C }, { XK_D, KEY_D },
+  { XK_E, KEY_E }, { XK_F, KEY_F }, { XK_G, KEY_G }, { XK_H, KEY_H },
+  { XK_I, KEY_I }, { XK_J, KEY_J }, { XK_K, KEY_K }, { XK_L, KEY_L },
+  { XK_M, KEY_M }, { XK_N, KEY_N }, { XK_O, KEY_O }, { XK_P, KEY_P },
+  { XK_Q, KEY_Q }, { XK_R, KEY_R }, { XK_S, KEY_S }, { XK_T, KEY_T },
+  { XK_U, KEY_U }, { XK_V, KEY_V }, { XK_W, KEY_W }, { XK_X, KEY_X },
+  { XK_Y, KEY_Y }, { XK_Z, KEY_Z },
+  { XK_1, KEY_1 }, { XK_2, KEY_2 }, { XK_3, KEY_3 }, { XK_4, KEY_4 },
+  { XK_5, KEY_5 }, { XK_6, KEY_6 }, { XK_7, KEY_7 }, { XK_8, KEY_8 },
+  { XK_9, KEY_9 }, { XK_0, KEY_0 },
+  { XK_exclam, KEY_1 }, { XK_at, KEY_2 }, { XK_numbersign, KEY_3 },
+  { XK_dollar, KEY_4 }, { XK_percent, KEY_5 }, { XK_asciicircum, KEY_6 },
+  { XK_ampersand, KEY_7 }, { XK_asterisk, KEY_8 }, { XK_parenleft, KEY_9 },
+  { XK_parenright, KEY_0 },
+  { XK_space, KEY_SPACE },
+  { XK_minus, KEY_MINUS }, { XK_underscore, KEY_MINUS },
+  { XK_equal, KEY_EQUAL }, { XK_plus, KEY_EQUAL },
+  { XK_bracketleft, KEY_LEFTBRACE }, { XK_braceleft, KEY_LEFTBRACE },
+  { XK_bracketright, KEY_RIGHTBRACE }, { XK_braceright, KEY_RIGHTBRACE },
+  { XK_backslash, KEY_BACKSLASH }, { XK_bar, KEY_BACKSLASH },
+  { XK_semicolon, KEY_SEMICOLON }, { XK_colon, KEY_SEMICOLON },
+  { XK_apostrophe, KEY_APOSTROPHE }, { XK_quotedbl, KEY_APOSTROPHE },
+  { XK_grave, KEY_GRAVE }, { XK_asciitilde, KEY_GRAVE },
+  { XK_comma, KEY_COMMA }, { XK_less, KEY_COMMA },
+  { XK_period, KEY_DOT }, { XK_greater, KEY_DOT },
+  { XK_slash, KEY_SLASH }, { XK_question, KEY_SLASH },
+  { XK_BackSpace, KEY_BACKSPACE }, { XK_Tab, KEY_TAB },
+  { XK_ISO_Left_Tab, KEY_TAB }, { XK_Return, KEY_ENTER },
+  { XK_Escape, KEY_ESC }, { XK_Delete, KEY_DELETE },
+  { XK_Insert, KEY_INSERT }, { XK_Home, KEY_HOME }, { XK_End, KEY_END },
+  { XK_Prior, KEY_PAGEUP }, { XK_Next, KEY_PAGEDOWN },
+  { XK_Left, KEY_LEFT }, { XK_Right, KEY_RIGHT },
+  { XK_Up, KEY_UP }, { XK_Down, KEY_DOWN },
+  { XK_Print, KEY_SYSRQ }, { XK_Pause, KEY_PAUSE }, { XK_Break, KEY_PAUSE },
+  { XK_Menu, KEY_COMPOSE },
+  { XK_Caps_Lock, KEY_CAPSLOCK }, { XK_Num_Lock, KEY_NUMLOCK },
+  { XK_Scroll_Lock, KEY_SCROLLLOCK },
+  { XK_Shift_L, KEY_LEFTSHIFT }, { XK_Shift_R, KEY_RIGHTSHIFT },
+  { XK_Control_L, KEY_LEFTCTRL }, { XK_Control_R, KEY_RIGHTCTRL },
+  { XK_Alt_L, KEY_LEFTALT }, { XK_Alt_R, KEY_RIGHTALT },
+  { XK_Meta_L, KEY_LEFTALT }, { XK_Meta_R, KEY_RIGHTALT },
+  { XK_ISO_Level3_Shift, KEY_RIGHTALT }, { XK_Mode_switch, KEY_RIGHTALT },
+  { XK_Super_L, KEY_LEFTMETA }, { XK_Super_R, KEY_RIGHTMETA },
+  { XK_Hyper_L, KEY_LEFTMETA }, { XK_Hyper_R, KEY_RIGHTMETA },
+  { XK_F1, KEY_F1 }, { XK_F2, KEY_F2 }, { XK_F3, KEY_F3 },
+  { XK_F4, KEY_F4 }, { XK_F5, KEY_F5 }, { XK_F6, KEY_F6 },
+  { XK_F7, KEY_F7 }, { XK_F8, KEY_F8 }, { XK_F9, KEY_F9 },
+  { XK_F10, KEY_F10 }, { XK_F11, KEY_F11 }, { XK_F12, KEY_F12 },
+  { XK_F13, KEY_F13 }, { XK_F14, KEY_F14 }, { XK_F15, KEY_F15 },
+  { XK_F16, KEY_F16 }, { XK_F17, KEY_F17 }, { XK_F18, KEY_F18 },
+  { XK_F19, KEY_F19 }, { XK_F20, KEY_F20 }, { XK_F21, KEY_F21 },
+  { XK_F22, KEY_F22 }, { XK_F23, KEY_F23 }, { XK_F24, KEY_F24 },
+  { XK_KP_0, KEY_KP0 }, { XK_KP_1, KEY_KP1 }, { XK_KP_2, KEY_KP2 },
+  { XK_KP_3, KEY_KP3 }, { XK_KP_4, KEY_KP4 }, { XK_KP_5, KEY_KP5 },
+  { XK_KP_6, KEY_KP6 }, { XK_KP_7, KEY_KP7 }, { XK_KP_8, KEY_KP8 },
+  { XK_KP_9, KEY_KP9 },
+  { XK_KP_Insert, KEY_KP0 }, { XK_KP_End, KEY_KP1 }, { XK_KP_Down, KEY_KP2 },
+  { XK_KP_Next, KEY_KP3 }, { XK_KP_Left, KEY_KP4 }, { XK_KP_Begin, KEY_KP5 },
+  { XK_KP_Right, KEY_KP6 }, { XK_KP_Home, KEY_KP7 }, { XK_KP_Up, KEY_KP8 },
+  { XK_KP_Prior, KEY_KP9 },
+  { XK_KP_Decimal, KEY_KPDOT }, { XK_KP_Delete, KEY_KPDOT },
+  { XK_KP_Add, KEY_KPPLUS }, { XK_KP_Subtract, KEY_KPMINUS },
+  { XK_KP_Multiply, KEY_KPASTERISK }, { XK_KP_Divide, KEY_KPSLASH },
+  { XK_KP_Enter, KEY_KPENTER }, { XK_KP_Equal, KEY_KPEQUAL },
+  { 0, 0 }
+};
+
+int
+uinput_keycode(KeySym sym)
+{
+  int i;
+  for (i = 0; keymap[i].sym; i++)
+    if (keymap[i].sym == sym)
+      return keymap[i].code;
+  return 0;
+}
+
+int
+init_uinput(void)
+{
+  int code;
+
+  uinput_fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
+  if (uinput_fd < 0) {
+    perror("/dev/uinput");
+    return 0;
+  }
+  if (ioctl(uinput_fd, UI_SET_EVBIT, EV_SYN) < 0 ||
+      ioctl(uinput_fd, UI_SET_EVBIT, EV_KEY) < 0 ||
+      ioctl(uinput_fd, UI_SET_EVBIT, EV_REL) < 0) {
+    perror("uinput ioctl");
+    goto err;
+  }
+  // All the regular keyboard keys (KEY_ESC .. KEY_MICMUTE), so that the key
+  // codes obtained from the X server will work, too.
+  for (code = KEY_ESC; code <= KEY_MICMUTE; code++)
+    ioctl(uinput_fd, UI_SET_KEYBIT, code);
+  // mouse buttons and scroll wheel (the relative axes are needed so that the
+  // device is recognized as a mouse)
+  ioctl(uinput_fd, UI_SET_KEYBIT, BTN_LEFT);
+  ioctl(uinput_fd, UI_SET_KEYBIT, BTN_MIDDLE);
+  ioctl(uinput_fd, UI_SET_KEYBIT, BTN_RIGHT);
+  ioctl(uinput_fd, UI_SET_RELBIT, REL_X);
+  ioctl(uinput_fd, UI_SET_RELBIT, REL_Y);
+  ioctl(uinput_fd, UI_SET_RELBIT, REL_WHEEL);
+#ifdef UI_DEV_SETUP
+  struct uinput_setup usetup;
+  memset(&usetup, 0, sizeof(usetup));
+  usetup.id.bustype = BUS_VIRTUAL;
+  strcpy(usetup.name, "midizap");
+  if (ioctl(uinput_fd, UI_DEV_SETUP, &usetup) < 0) {
+    perror("uinput ioctl");
+    goto err;
+  }
+#else
+  // older kernels (< 4.5)
+  struct uinput_user_dev udev;
+  memset(&udev, 0, sizeof(udev));
+  udev.id.bustype = BUS_VIRTUAL;
+  strcpy(udev.name, "midizap");
+  if (write(uinput_fd, &udev, sizeof(udev)) != sizeof(udev)) {
+    perror("uinput write");
+    goto err;
+  }
+#endif
+  if (ioctl(uinput_fd, UI_DEV_CREATE) < 0) {
+    perror("uinput ioctl");
+    goto err;
+  }
+  return 1;
+ err:
+  close(uinput_fd);
+  uinput_fd = -1;
+  return 0;
+}
+
+void
+close_uinput(void)
+{
+  if (uinput_fd >= 0) {
+    uinput_flush();
+    ioctl(uinput_fd, UI_DEV_DESTROY);
+    close(uinput_fd);
+    uinput_fd = -1;
+  }
+}
+
+static void add_event(int type, int code, int value)
+{
+  // make sure that we have room for the event and the following SYN_REPORT
+  if (n_events+2 > MAX_EVENTS) uinput_flush();
+  memset(&events[n_events], 0, sizeof(struct input_event));
+  events[n_events].type = type;
+  events[n_events].code = code;
+  events[n_events].value = value;
+  n_events++;
+  memset(&events[n_events], 0, sizeof(struct input_event));
+  events[n_events].type = EV_SYN;
+  events[n_events].code = SYN_REPORT;
+  n_events++;
+}
+
+void
+uinput_send_key(int code, int press)
+{
+  if (uinput_fd >= 0 && code > 0) add_event(EV_KEY, code, press!=0);
+}
+
+void
+uinput_send_button(unsigned int button, int press)
+{
+  static const int buttons[] = { BTN_LEFT, BTN_MIDDLE, BTN_RIGHT };
+  if (uinput_fd < 0) return;
+  if (button >= 1 && button <= 3)
+    add_event(EV_KEY, buttons[button-1], press!=0);
+  else if (press && (button == 4 || button == 5))
+    // scroll wheel (like X, we do one step for each "press")
+    add_event(EV_REL, REL_WHEEL, button == 4 ? 1 : -1);
+}
+
+void
+uinput_flush(void)
+{
+  size_t len = n_events*sizeof(struct input_event), pos = 0;
+  while (pos < len) {
+    ssize_t ret = write(uinput_fd, (char*)events+pos, len-pos);
+    if (ret < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN) {
+	// The device is opened in non-blocking mode, so wait until it's
+	// ready to take more events instead of spinning, but don't hang
+	// forever if it never is.
+	struct pollfd pfd = { uinput_fd, POLLOUT, 0 };
+	int n = poll(&pfd, 1, 1000);
+	if (n > 0 || (n < 0 && errno == EINTR)) continue;
+	fprintf(stderr, "uinput write: timed out, %d events dropped\n",
+		(int)((len-pos)/sizeof(struct input_event)));
+	break;
+      }
+      perror("uinput write");
+      break;
+    }
+    pos += ret;
+  }
+  n_events = 0;
+}
@@ -0,0 +1,13 @@
+#ifndef UINPUT_H
+#define UINPUT_H
+
+#include <X11/X.h>
+
+int init_uinput(void);
+void close_uinput(void);
+int uinput_keycode(KeySym sym);
+void uinput_send_key(int code, int press);
+void uinput_send_button(unsigned int button, int press);
+void uinput_flush(void);
+
+#endif